@@ -16,6 +16,9 @@
 
 #include <lol/engine.h>
 
+#include <algorithm>
+#include <cctype>
+#include <cstring>
 #include <string>
 #include <regex>
 
@@ -98,5 +101,225 @@ std::string analyzer::fix(std::string const &code)
     return std::regex_replace(code, pattern, "");
 }
 
+// Match rule R at the start of [p, end) and return the match length,
+// or zero if it does not match.
+template<typename R>
+static size_t lex(char const *p, char const *end)
+{
+    pegtl::memory_input<> in(p, end, "");
+    return pegtl::parse<R>(in) ? size_t(in.current() - p) : 0;
+}
+
+bool token::ends_expression() const
+{
+    switch (kind)
+    {
+    case type::name:
+    case type::number:
+    case type::string:
+        return true;
+    case type::keyword:
+        return text == "end" || text == "nil" || text == "true" || text == "false";
+    case type::op:
+        return text == ")" || text == "]" || text == "}" || text == "...";
+    default:
+        return false;
+    }
+}
+
+size_t analyzer::match_operator(std::string_view s)
+{
+    // PICO-8 operators, longest first
+    static std::string_view const operators[] =
+    {
+        ">>>=", "<<>=", ">><=",
+        "...", "..=", ">>>", "<<>", ">><", "^^=", "<<=", ">>=",
+        "..", "==", "~=", "!=", "<=", ">=", "<<", ">>", "^^", "::",
+        "+=", "-=", "*=", "/=", "\\=", "%=", "^=", "|=", "&=",
+    };
+
+    if (s.size() < 2)
+        return s.size();
+    for (auto const &op : operators)
+        if (op[0] == s[0] && op[1] == s[1] && s.substr(0, op.size()) == op)
+            return op.size();
+    return 1;
+}
+
+bool analyzer::tokenize(std::string_view code, std::vector<token> &tokens)
+{
+    char const *p = code.data(), *end = p + code.size();
+    int line = 1;
+
+    tokens.clear();
+    tokens.reserve(code.size() / 4);
+
+    try
+    {
+        while (p < end)
+        {
+            uint8_t ch = uint8_t(*p), next = p + 1 < end ? uint8_t(p[1]) : 0;
+
+            if (ch <= ' ')
+            {
+                line += ch == '\n';
+                ++p;
+                continue;
+            }
+
+            // Dispatch on the first characters so that only one rule of
+            // the grammar needs to be tried.
+            token::type kind = token::type::op;
+            size_t n = 0;
+
+            if (ch == '-' && next == '-')
+                n = lex<lua53::comment>(p, end), kind = token::type::comment;
+            else if (ch == '/' && next == '/')
+                n = lex<lua53::cpp_comment>(p, end), kind = token::type::comment;
+            else if (ch == '"' || ch == '\'' || (ch == '[' && (next == '[' || next == '=')))
+                n = lex<lua53::literal_string>(p, end), kind = token::type::string;
+            else if (isdigit(ch) || (ch == '.' && isdigit(next)))
+                n = lex<lua53::numeral>(p, end), kind = token::type::number;
+            else if (isalpha(ch) || ch == '_')
+            {
+                n = std::max(lex<lua53::keyword>(p, end), lex<lua53::key_or>(p, end));
+                kind = token::type::keyword;
+                if (!n)
+                    n = lex<pegtl::identifier>(p, end), kind = token::type::name;
+            }
+            else if (ch >= 0x80)
+            {
+                // P8SCII glyphs are valid identifiers
+                while (p + n < end && uint8_t(p[n]) >= 0x80)
+                    ++n;
+                kind = token::type::name;
+            }
+
+            if (!n)
+            {
+                n = match_operator(std::string_view(p, end - p));
+                kind = token::type::op;
+            }
+
+            tokens.push_back(token{ kind, std::string_view(p, n), line });
+            line += int(std::count(p, p + n, '\n'));
+            p += n;
+        }
+    }
+    catch (pegtl::parse_error const &)
+    {
+        msg::error("lexical error at line %d\n", line);
+        return false;
+    }
+
+    return true;
+}
+
+// PICO-8 does not count commas, periods, colons, semicolons, closing
+// brackets, “end” and “local”, nor a unary minus or tilde in front of
+// a numeric literal. The previous token is needed to tell unary minus
+// from subtraction.
+static bool is_counted(std::vector<token> const &tokens, size_t i, token const *prev)
+{
+    auto const &t = tokens[i];
+
+    if (t.kind == token::type::comment)
+        return false;
+
+    if (t.kind == token::type::keyword)
+        return t.text != "end" && t.text != "local";
+
+    if (t.kind != token::type::op)
+        return true;
+
+    if ((t.text == "-" || t.text == "~") && !(prev && prev->ends_expression()))
+    {
+        size_t j = i + 1;
+        while (j < tokens.size() && tokens[j].kind == token::type::comment)
+            ++j;
+        return j >= tokens.size() || tokens[j].kind != token::type::number;
+    }
+
+    return t.text.size() == 1 ? strchr(",.:;)]}", t.text[0]) == nullptr
+                              : t.text != "::";
+}
+
+int analyzer::count_tokens(std::vector<token> const &tokens)
+{
+    int count = 0;
+    token const *prev = nullptr;
+
+    for (size_t i = 0; i < tokens.size(); ++i)
+    {
+        if (tokens[i].kind == token::type::comment)
+            continue;
+        count += is_counted(tokens, i, prev) ? 1 : 0;
+        prev = &tokens[i];
+    }
+
+    return count;
+}
+
+std::vector<function_tokens> analyzer::count_function_tokens(std::vector<token> const &tokens)
+{
+    std::vector<function_tokens> ret(1, function_tokens{ "(main)", 1, 0 });
+
+    // For each open block, the function it belongs to, and whether the
+    // block is that function’s body. Blocks are opened by “function”,
+    // “do”, “then” and “repeat”, and closed by “end” and “until”; the
+    // short forms of “if” and “while” have neither.
+    std::vector<std::pair<size_t, bool>> blocks;
+    token const *prev = nullptr;
+    bool elseif = false;
+
+    for (size_t i = 0; i < tokens.size(); ++i)
+    {
+        auto const &t = tokens[i];
+        if (t.kind == token::type::comment)
+            continue;
+
+        size_t owner = blocks.empty() ? 0 : blocks.back().first;
+
+        if (t.kind == token::type::keyword)
+        {
+            if (t.text == "function")
+            {
+                // Named after the function name, or the variable or field
+                // it is assigned to.
+                std::string name;
+                for (size_t j = i + 1; j < tokens.size() && (tokens[j].kind == token::type::name
+                        || tokens[j].is(token::type::op, ".") || tokens[j].is(token::type::op, ":")); ++j)
+                    name += tokens[j].text;
+                if (name.empty() && i >= 2 && tokens[i - 1].is(token::type::op, "=")
+                     && tokens[i - 2].kind == token::type::name)
+                    name = tokens[i - 2].text;
+
+                owner = ret.size();
+                ret.push_back(function_tokens{ name.empty() ? "(anonymous)" : name, t.line, 0 });
+                blocks.push_back(std::make_pair(owner, true));
+            }
+            else if (t.text == "elseif")
+                elseif = true;
+            else if ((t.text == "then" && !elseif) || t.text == "do" || t.text == "repeat")
+                blocks.push_back(std::make_pair(owner, false));
+            else if ((t.text == "end" || t.text == "until") && !blocks.empty())
+                blocks.pop_back();
+
+            if (t.text == "then")
+                elseif = false;
+        }
+
+        ret[owner].tokens += is_counted(tokens, i, prev) ? 1 : 0;
+        prev = &t;
+    }
+
+    return ret;
+}
+
+int analyzer::count_chars(std::string_view p8scii)
+{
+    return int(p8scii.length());
+}
+
 } // namespace z8
 
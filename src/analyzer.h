@@ -14,7 +14,10 @@
 
 #include <lol/engine.h>
 
+#include <cstdint>
 #include <string>
+#include <string_view>
+#include <vector>
 
 // The analyzer class
 // ——————————————————
@@ -22,15 +25,65 @@
 // regular Lua code. Now that we use z8lua instead of Lua, this is no longer
 // required, and the fix() function just adds some backwards compatibility
 // glue code to the source.
+//
+// It also splits code into tokens using the lexical rules of the grammar,
+// which is what the minifier and the token counter work on.
 
 namespace z8
 {
 
+struct token
+{
+    enum class type : uint8_t
+    {
+        name, keyword, number, string, op, comment,
+    };
+
+    bool is(type t, std::string_view s) const { return kind == t && text == s; }
+
+    // Whether an expression may end with this token
+    bool ends_expression() const;
+
+    type kind;
+    std::string_view text; // points into the tokenised code
+    int line;
+};
+
+// Number of tokens in a function, not counting nested functions
+struct function_tokens
+{
+    std::string name;
+    int line;
+    int tokens;
+};
+
 class analyzer
 {
 public:
+    // Its output is stored in cart caches: bump cache_version in
+    // pico8/cart.cpp whenever it changes
     std::string fix(std::string const &str);
 
+    // Split code into tokens, in a single pass. Whitespace is dropped but
+    // comments are kept. Returns false on unterminated strings and other
+    // lexical errors.
+    static bool tokenize(std::string_view code, std::vector<token> &tokens);
+
+    // Length of the longest operator at the start of s, or 1 if there is
+    // none, since unknown characters are single-character tokens.
+    static size_t match_operator(std::string_view s);
+
+    // Count tokens the way PICO-8 does for its 8192 token limit
+    static int count_tokens(std::vector<token> const &tokens);
+
+    // Same, per function, in order of appearance. The first entry is for
+    // the code outside any function; the counts add up to the total.
+    static std::vector<function_tokens> count_function_tokens(std::vector<token> const &tokens);
+
+    // Count characters the way PICO-8 does for its 65535 character limit:
+    // one per P8SCII glyph, so code in UTF-8 must be converted first
+    static int count_chars(std::string_view p8scii);
+
     int m_disable_crlf = 0;
 };
 
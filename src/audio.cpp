@@ -0,0 +1,219 @@
+//
+//  ZEPTO-8 — Fantasy console emulator
+//
+//  Copyright © 2016—2020 Sam Hocevar <sam@hocevar.net>
+//
+//  This program is free software. It comes without any warranty, to
+//  the extent permitted by applicable law. You can redistribute it
+//  and/or modify it under the terms of the Do What the Fuck You Want
+//  to Public License, Version 2, as published by the WTFPL Task Force.
+//  See http://www.wtfpl.net/ for more details.
+//
+
+#if HAVE_CONFIG_H
+#   include "config.h"
+#endif
+
+#include <lol/engine.h>
+
+#include <atomic>
+#include <fstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "audio.h"
+#include "pico8/cart.h"
+#include "pico8/vm.h"
+
+namespace z8
+{
+
+using lol::msg;
+
+// Safety net in case a song never loops back nor ends
+static float const max_seconds = 600.f;
+
+static void put_le(std::ofstream &f, uint32_t x, int bytes)
+{
+    for (int i = 0; i < bytes; ++i, x >>= 8)
+        f.put((char)(x & 0xff));
+}
+
+static bool write_wav(std::string const &name, std::vector<int16_t> const &samples,
+                      int rate)
+{
+    std::ofstream f(name, std::ios::binary);
+    if (!f)
+    {
+        msg::error("cannot open %s for writing\n", name.c_str());
+        return false;
+    }
+
+    uint32_t const data_size = uint32_t(samples.size() * sizeof(int16_t));
+
+    f.write("RIFF", 4);
+    put_le(f, 36 + data_size, 4);
+    f.write("WAVEfmt ", 8);
+    put_le(f, 16, 4); // subchunk size
+    put_le(f, 1, 2); // format (PCM)
+    put_le(f, 1, 2); // channels
+    put_le(f, rate, 4);
+    put_le(f, rate * 2, 4); // byte rate
+    put_le(f, 2, 2); // block align
+    put_le(f, 16, 2); // bits per sample
+    f.write("data", 4);
+    put_le(f, data_size, 4);
+    for (int16_t s : samples)
+        put_le(f, (uint16_t)s, 2);
+
+    return bool(f);
+}
+
+static std::vector<int16_t> render(pico8::memory const &rom, bool is_music, int n,
+                                   int rate)
+{
+    int const block = 1024;
+
+    // The cart code is never run; only the audio data is needed.
+    pico8::vm vm;
+    memcpy(std::get<0>(vm.ram()), &rom, 0x4300);
+
+    if (is_music)
+        vm.start_music(n);
+    else
+        vm.start_sfx(n);
+
+    auto streamer = vm.get_streamer(rate);
+    std::vector<int16_t> samples;
+
+    // A looping SFX never stops by itself, so only render it up to the
+    // end of its first pass through the loop, at 183 samples per speed
+    // unit per note at 22050 Hz.
+    size_t max_samples = size_t(max_seconds * rate);
+    if (!is_music)
+    {
+        auto const &sfx = rom.sfx[n];
+        if (sfx.loop_start < sfx.loop_end)
+        {
+            int const speed = lol::max(1, (int)sfx.speed);
+            int const notes = lol::min((int)sfx.loop_end, 32);
+            max_samples = lol::min(max_samples,
+                                   size_t(notes) * speed * 183 * rate / 22050);
+        }
+    }
+
+    bool visited[64] = { false };
+    int count = -1;
+
+    while (samples.size() < max_samples)
+    {
+        samples.resize(samples.size() + block);
+        streamer(&samples[samples.size() - block], block * sizeof(int16_t));
+
+        int const pattern = vm.get_audio_stat(24);
+        bool playing = pattern >= 0;
+        for (int i = 16; i < 20; ++i)
+            playing |= vm.get_audio_stat(i) >= 0;
+        if (!playing)
+            break;
+
+        // Stop music when it goes back to a pattern it already played
+        if (is_music && pattern >= 0 && vm.get_audio_stat(25) != count)
+        {
+            if (visited[pattern])
+                break;
+            visited[pattern] = true;
+            count = vm.get_audio_stat(25);
+        }
+    }
+
+    // Trim the last block and trailing silence
+    if (samples.size() > max_samples)
+        samples.resize(max_samples);
+    while (samples.size() && samples.back() == 0)
+        samples.pop_back();
+
+    return samples;
+}
+
+static bool load_rom(std::string const &name, pico8::cart &cart)
+{
+    if (!cart.load(name))
+    {
+        msg::error("cannot load cart %s\n", name.c_str());
+        return false;
+    }
+    return true;
+}
+
+bool render_audio(std::string const &name, bool is_music, int n,
+                  std::string const &out, int rate)
+{
+    pico8::cart cart;
+    if (!load_rom(name, cart))
+        return false;
+
+    return write_wav(out, render(cart.get_rom(), is_music, n, rate), rate);
+}
+
+bool render_all_audio(std::string const &name, std::string const &prefix, int rate)
+{
+    pico8::cart cart;
+    if (!load_rom(name, cart))
+        return false;
+
+    auto const &rom = cart.get_rom();
+
+    // Build the job list: 0..63 are SFX, 64..127 are music patterns
+    std::vector<int> jobs;
+    for (int i = 0; i < 64; ++i)
+    {
+        auto const &sfx = rom.sfx[i];
+        for (auto const &note : sfx.notes)
+            if (note.volume)
+            {
+                jobs.push_back(i);
+                break;
+            }
+    }
+    for (int i = 0; i < 64; ++i)
+    {
+        auto const &song = rom.song[i];
+        for (int ch = 0; ch < 4; ++ch)
+            if (!(song.sfx(ch) & 0x40))
+            {
+                jobs.push_back(64 + i);
+                break;
+            }
+    }
+
+    std::atomic<size_t> next(0);
+    std::atomic<bool> success(true);
+
+    auto worker = [&]()
+    {
+        for (size_t i; (i = next++) < jobs.size(); )
+        {
+            bool const is_music = jobs[i] >= 64;
+            int const n = jobs[i] & 63;
+            auto out = lol::format("%s%s_%02d.wav", prefix.c_str(),
+                                   is_music ? "music" : "sfx", n);
+            if (!write_wav(out, render(rom, is_music, n, rate), rate))
+                success = false;
+        }
+    };
+
+    std::vector<std::thread> threads;
+    int const count = lol::max(1, (int)std::thread::hardware_concurrency());
+    for (int i = 0; i < count; ++i)
+        threads.push_back(std::thread(worker));
+    for (auto &t : threads)
+        t.join();
+
+    msg::info("rendered %d files\n", (int)jobs.size());
+    return success;
+}
+
+} // namespace z8
+
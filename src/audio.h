@@ -0,0 +1,31 @@
+//
+//  ZEPTO-8 — Fantasy console emulator
+//
+//  Copyright © 2016—2020 Sam Hocevar <sam@hocevar.net>
+//
+//  This program is free software. It comes without any warranty, to
+//  the extent permitted by applicable law. You can redistribute it
+//  and/or modify it under the terms of the Do What the Fuck You Want
+//  to Public License, Version 2, as published by the WTFPL Task Force.
+//  See http://www.wtfpl.net/ for more details.
+//
+
+#pragma once
+
+#include <string>
+
+namespace z8
+{
+
+// Render a single SFX or music pattern of a cart to a WAV file, as fast
+// as possible. Music stops when the song ends or loops, and looping SFX
+// after one pass through their loop.
+bool render_audio(std::string const &cart, bool is_music, int n,
+                  std::string const &out, int rate);
+
+// Render every non-empty SFX and music pattern of a cart in parallel,
+// to files called <prefix>sfx_NN.wav and <prefix>music_NN.wav
+bool render_all_audio(std::string const &cart, std::string const &prefix, int rate);
+
+} // namespace z8
+
@@ -0,0 +1,296 @@
+//
+//  ZEPTO-8 — Fantasy console emulator
+//
+//  Copyright © 2016—2020 Sam Hocevar <sam@hocevar.net>
+//
+//  This program is free software. It comes without any warranty, to
+//  the extent permitted by applicable law. You can redistribute it
+//  and/or modify it under the terms of the Do What the Fuck You Want
+//  to Public License, Version 2, as published by the WTFPL Task Force.
+//  See http://www.wtfpl.net/ for more details.
+//
+
+#if HAVE_CONFIG_H
+#   include "config.h"
+#endif
+
+#include <lol/engine.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "batch.h"
+#include "analyzer.h"
+#include "pico8/cart.h"
+#include "pico8/pxa.h"
+
+namespace z8
+{
+
+using lol::msg;
+
+namespace fs = std::filesystem;
+
+static char const *cart_extensions[] = { ".p8.png", ".p8", ".z8c" };
+
+// Return the cart file name without its extension, or an empty string
+// if it does not look like a cart
+static std::string cart_stem(std::string const &name)
+{
+    for (auto ext : cart_extensions)
+        if (lol::ends_with(name, ext))
+            return name.substr(0, name.length() - strlen(ext));
+    return "";
+}
+
+static bool write_file(fs::path const &name, void const *data, size_t size)
+{
+    std::ofstream f(name, std::ios::binary);
+    f.write((char const *)data, size);
+    return bool(f);
+}
+
+static bool convert(fs::path const &in, fs::path out, cart_format format, bool pxa)
+{
+    pico8::cart cart;
+    if (!cart.load(in.string()))
+        return false;
+
+    std::error_code ec;
+    fs::create_directories(out.parent_path(), ec);
+
+    switch (format)
+    {
+    case cart_format::lua:
+    {
+        auto const &lua = cart.get_lua();
+        return write_file(out += ".lua", lua.data(), lua.length());
+    }
+    case cart_format::p8:
+    {
+        auto const &p8 = cart.get_p8();
+        return write_file(out += ".p8", p8.data(), p8.length());
+    }
+    case cart_format::png:
+        return cart.save_png((out += ".p8.png").string(), pxa);
+    case cart_format::bin:
+    {
+        auto const &bin = cart.get_bin(pxa);
+        return write_file(out += ".bin", bin.data(), bin.size());
+    }
+    case cart_format::data:
+        return write_file(out += ".data", &cart.get_rom(), 0x4300);
+    case cart_format::cache:
+    {
+        // Caches are named after their source hash, as in single cart mode
+        auto const &cache = cart.get_cache();
+        out.replace_filename(lol::format("%016llx.z8c", (unsigned long long)cart.get_hash()));
+        return write_file(out, cache.data(), cache.size());
+    }
+    }
+
+    return false;
+}
+
+// Call f for each cart found in inputs, with the cart path, the directory
+// it was found in relative to its input directory, and its stem
+static void find_carts(std::vector<std::string> const &inputs,
+                       std::function<void(fs::path const &, fs::path const &,
+                                          std::string const &)> const &f)
+{
+    for (auto const &input : inputs)
+    {
+        std::error_code ec;
+        if (fs::is_directory(input, ec))
+        {
+            for (auto const &entry : fs::recursive_directory_iterator(input, ec))
+            {
+                auto stem = cart_stem(entry.path().filename().string());
+                if (entry.is_regular_file() && stem.length())
+                    f(entry.path(), fs::relative(entry.path(), input, ec).parent_path(), stem);
+            }
+        }
+        else
+        {
+            auto stem = cart_stem(fs::path(input).filename().string());
+            if (stem.empty())
+                stem = fs::path(input).stem().string();
+            f(fs::path(input), fs::path(), stem);
+        }
+    }
+}
+
+// Call f for each index in [0, count) on all cores
+static void parallel_for(size_t count, std::function<void(size_t)> const &f)
+{
+    std::atomic<size_t> next(0);
+
+    auto worker = [&]()
+    {
+        for (size_t i; (i = next++) < count; )
+            f(i);
+    };
+
+    std::vector<std::thread> threads;
+    int const threadcount = lol::max(1, (int)std::thread::hardware_concurrency());
+    for (int i = 0; i < threadcount; ++i)
+        threads.push_back(std::thread(worker));
+    for (auto &t : threads)
+        t.join();
+}
+
+bool convert_carts(std::vector<std::string> const &inputs,
+                   std::string const &outdir, cart_format format, bool pxa)
+{
+    // Build the job list: each entry is an input file and its output
+    // path without an extension. If two carts only differ by extension,
+    // e.g. foo.p8 and foo.p8.png, the second one keeps its full name.
+    std::vector<std::pair<fs::path, fs::path>> jobs;
+    std::set<fs::path> used;
+
+    find_carts(inputs, [&](fs::path const &in, fs::path const &rel, std::string const &stem)
+    {
+        fs::path const dir = fs::path(outdir) / rel;
+        fs::path out = dir / stem;
+        if (!used.insert(out).second)
+            used.insert(out = dir / in.filename());
+        jobs.push_back(std::make_pair(in, out));
+    });
+
+    std::atomic<int> failures(0);
+
+    parallel_for(jobs.size(), [&](size_t i)
+    {
+        if (!convert(jobs[i].first, jobs[i].second, format, pxa))
+        {
+            msg::error("failed to convert %s\n", jobs[i].first.string().c_str());
+            ++failures;
+        }
+    });
+
+    msg::info("converted %d carts, %d failures\n",
+              (int)jobs.size() - failures, (int)failures);
+    return failures == 0;
+}
+
+// Code size figures against the PICO-8 limits, on one line, or with a
+// per-function token breakdown, and optionally the PXA codec throughput
+static bool inspect(fs::path const &in, bool details, bool bench, std::string &report)
+{
+    pico8::cart cart;
+    if (!cart.load(in.string()))
+        return false;
+
+    auto const &code = cart.get_code();
+    std::vector<token> tokens;
+    if (!analyzer::tokenize(code, tokens))
+        return false;
+
+    int const max_tokens = 8192, max_chars = 65535;
+    int const max_compressed = int(sizeof(pico8::memory::code));
+    int const token_count = analyzer::count_tokens(tokens);
+    int const char_count = analyzer::count_chars(code);
+    int const compressed = int(pico8::pxa::compress(code).size());
+    if (!compressed)
+    {
+        msg::error("%s: code is too large for PXA\n", in.string().c_str());
+        return false;
+    }
+
+    std::string throughput;
+    if (bench)
+    {
+        int const runs = 20;
+        lol::timer t;
+        std::vector<uint8_t> pxa;
+        for (int i = 0; i < runs; ++i)
+            pxa = pico8::pxa::compress(code);
+        float const compress_time = t.get() / runs;
+        std::string tmp;
+        for (int i = 0; i < runs; ++i)
+            pico8::pxa::decompress(pxa.data(), pxa.size(), tmp);
+        float const decompress_time = t.get() / runs;
+        throughput = lol::format("PXA compress %.1f MB/s, decompress %.1f MB/s",
+                                 code.length() / compress_time * 1e-6f,
+                                 code.length() / decompress_time * 1e-6f);
+    }
+
+    if (!details)
+    {
+        report = lol::format("%s: %d/%d tokens, %d/%d chars, %d/%d compressed",
+                             in.string().c_str(), token_count, max_tokens,
+                             char_count, max_chars, compressed, max_compressed);
+        report += bench ? ", " + throughput + "\n" : "\n";
+        return true;
+    }
+
+    report = lol::format("Tokens: %d/%d (%d%%)\n", token_count, max_tokens,
+                         token_count * 100 / max_tokens);
+    report += lol::format("Characters: %d/%d (%d%%)\n", char_count, max_chars,
+                          char_count * 100 / max_chars);
+    report += lol::format("Compressed code size: %d/%d (%d%%)\n", compressed,
+                          max_compressed, compressed * 100 / max_compressed);
+    if (bench)
+        report += throughput + "\n";
+
+    // Largest functions first
+    auto functions = analyzer::count_function_tokens(tokens);
+    std::stable_sort(functions.begin(), functions.end(),
+                     [](function_tokens const &a, function_tokens const &b)
+                     { return a.tokens > b.tokens; });
+
+    report += "Tokens per function:\n";
+    for (auto const &f : functions)
+        report += lol::format("%7d  %s (line %d)\n", f.tokens, f.name.c_str(), f.line);
+
+    return true;
+}
+
+bool inspect_carts(std::vector<std::string> const &inputs, bool bench)
+{
+    std::vector<fs::path> carts;
+    find_carts(inputs, [&](fs::path const &in, fs::path const &, std::string const &)
+    {
+        carts.push_back(in);
+    });
+
+    // Reports are printed in order once all carts are done
+    std::vector<std::string> reports(carts.size());
+    std::atomic<int> failures(0);
+    bool const details = carts.size() == 1;
+
+    auto job = [&](size_t i)
+    {
+        if (!inspect(carts[i], details, bench, reports[i]))
+        {
+            msg::error("failed to inspect %s\n", carts[i].string().c_str());
+            ++failures;
+        }
+    };
+
+    // Benchmarks run one cart at a time so that threads do not skew them
+    if (bench)
+        for (size_t i = 0; i < carts.size(); ++i)
+            job(i);
+    else
+        parallel_for(carts.size(), job);
+
+    for (auto const &report : reports)
+        printf("%s", report.c_str());
+
+    if (!details)
+        msg::info("inspected %d carts, %d failures\n",
+                  (int)carts.size() - failures, (int)failures);
+    return failures == 0;
+}
+
+} // namespace z8
+
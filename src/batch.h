@@ -0,0 +1,50 @@
+//
+//  ZEPTO-8 — Fantasy console emulator
+//
+//  Copyright © 2016—2020 Sam Hocevar <sam@hocevar.net>
+//
+//  This program is free software. It comes without any warranty, to
+//  the extent permitted by applicable law. You can redistribute it
+//  and/or modify it under the terms of the Do What the Fuck You Want
+//  to Public License, Version 2, as published by the WTFPL Task Force.
+//  See http://www.wtfpl.net/ for more details.
+//
+
+#pragma once
+
+#include <string>
+#include <vector>
+
+namespace z8
+{
+
+enum class cart_format
+{
+    lua,
+    p8,
+    png,
+    bin,
+    data,
+    cache,
+};
+
+// Convert many carts at once, in parallel. Inputs are cart files or
+// directories that are scanned recursively for carts. Output files are
+// written to outdir, keeping the layout of input directories. Failures
+// are reported but do not stop the batch; returns false if any happened.
+// PNG and binary carts get PXA compressed code if pxa is set. Each cart
+// is loaded and written on a worker thread; pico8::cart serialises its
+// image codec calls, and the rest of its loading and saving code only
+// shares immutable tables.
+bool convert_carts(std::vector<std::string> const &inputs,
+                   std::string const &outdir, cart_format format, bool pxa);
+
+// Report the token count, character count and compressed code size of
+// carts against the PICO-8 limits. Inputs are handled as above; several
+// carts get one line each, a single cart also gets its token count per
+// function. With bench, the PXA compression and decompression throughput
+// is measured too. Returns false if any cart could not be inspected.
+bool inspect_carts(std::vector<std::string> const &inputs, bool bench);
+
+} // namespace z8
+
@@ -0,0 +1,116 @@
+//
+//  ZEPTO-8 — Fantasy console emulator
+//
+//  Copyright © 2016—2020 Sam Hocevar <sam@hocevar.net>
+//
+//  This program is free software. It comes without any warranty, to
+//  the extent permitted by applicable law. You can redistribute it
+//  and/or modify it under the terms of the Do What the Fuck You Want
+//  to Public License, Version 2, as published by the WTFPL Task Force.
+//  See http://www.wtfpl.net/ for more details.
+//
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Bit stream helpers
+// ——————————————————
+// Both deflate and PICO-8’s PXA format store bits LSB first within each
+// byte, so a single reader and writer pair serves all our codecs.
+
+namespace z8
+{
+
+class bit_reader
+{
+public:
+    bit_reader(uint8_t const *data, size_t size)
+      : m_data(data), m_end(data + size)
+    {}
+
+    // Look at the next n bits (n ≤ 32) without consuming them
+    uint32_t peek(int n)
+    {
+        refill();
+        return uint32_t(m_bits & ((uint64_t(1) << n) - 1));
+    }
+
+    void skip(int n)
+    {
+        m_bits >>= n;
+        m_count -= n;
+    }
+
+    uint32_t get(int n)
+    {
+        uint32_t ret = peek(n);
+        skip(n);
+        return ret;
+    }
+
+    // Skip to the next byte boundary
+    void align()
+    {
+        skip(m_count & 7);
+    }
+
+    // True if we read past the end of the input data; missing bits
+    // are read as zeroes until then.
+    bool overrun() const
+    {
+        return m_padding * 8 > m_count;
+    }
+
+private:
+    void refill()
+    {
+        while (m_count <= 56)
+        {
+            if (m_data < m_end)
+                m_bits |= uint64_t(*m_data++) << m_count;
+            else
+                ++m_padding;
+            m_count += 8;
+        }
+    }
+
+    uint8_t const *m_data, *m_end;
+    uint64_t m_bits = 0;
+    int m_count = 0, m_padding = 0;
+};
+
+class bit_writer
+{
+public:
+    bit_writer(std::vector<uint8_t> &out)
+      : m_out(out)
+    {}
+
+    // Append the n low bits of x (n ≤ 32)
+    void put(uint32_t x, int n)
+    {
+        m_bits |= uint64_t(x & ((uint64_t(1) << n) - 1)) << m_count;
+        for (m_count += n; m_count >= 8; m_count -= 8, m_bits >>= 8)
+            m_out.push_back(uint8_t(m_bits));
+    }
+
+    // Pad the last byte with zeroes
+    void flush()
+    {
+        if (m_count > 0)
+            m_out.push_back(uint8_t(m_bits));
+        m_bits = 0;
+        m_count = 0;
+    }
+
+private:
+    std::vector<uint8_t> &m_out;
+    uint64_t m_bits = 0;
+    int m_count = 0;
+};
+
+} // namespace z8
+
@@ -15,14 +15,17 @@
 #endif
 
 #include "compress.h"
+#include "inflate.h"
+#include "bits.h"
 
 #include <string>
 #include <vector>
 #include <iostream>
 #include <streambuf>
+#include <algorithm>
 #include <cstdint>
 #include <cstdlib>
-#include <regex>
+#include <cstring>
 
 extern "C" {
 #define register /**/
@@ -37,79 +40,167 @@ extern z_const char * const z_errmsg[] = {};
 namespace z8
 {
 
+static char const *base59 = "\n,i])v+=e%1*c579}f#k<lmax>0q/42368ghjnprwyz!{:;.~_do t[sub(";
+
 std::string encode59(std::vector<uint8_t> const &v)
 {
-    char const *chr = "\n,i])v+=e%1*c579}f#k<lmax>0q/42368ghjnprwyz!{:;.~_do t[sub(";
     int const n = 47;
     int const p = 59;
 
-    std::string ret;
+    // Convert each group of 47 bits to 8 base 59 digits
+    std::string digits;
+    digits.reserve((v.size() * 8 + n - 1) / n * 8);
 
-    // Read all the data
+    bit_reader br(v.data(), v.size());
     for (size_t pos = 0; pos < v.size() * 8; pos += n)
     {
-        // Read a group of 47 bits
-        uint64_t val = 0;
-        for (size_t i = pos / 8; i <= (pos + n - 1) / 8 && i < v.size(); ++i)
-            val |= (uint64_t)v[i] << ((i - pos / 8) * 8);
-        val = (val >> (pos % 8)) & (((uint64_t)1 << n) - 1);
+        uint64_t val = br.get(24);
+        val |= (uint64_t)br.get(n - 24) << 24;
 
-        // Convert those 47 bits to a string
         for (int i = 0; i < 8; ++i)
         {
-            ret += chr[val % p];
+            digits += base59[val % p];
             val /= p;
         }
     }
 
     // Remove trailing newlines
-    while (ret.size() && ret.back() == '\n')
-        ret.erase(ret.end() - 1);
-
-    // If string starts with \n we need to add an extra \n for Lua
-    if (ret.size() && ret[0] == '\n')
-        ret = '\n' + ret;
-
-#if 1
-    // Workaround for a PICO-8 bug that freezes everything… 10 chars wasted!
-    // fixed in 1.1.12: https://www.lexaloffle.com/bbs/?tid=31673
-    // This should not happen because we are inside a string and nothing
-    // needs to be parsed, but apparently the PICO-8 parser starts parsing
-    // stuff after "]]" even if inside "[=[".
-    ret = std::regex_replace(ret, std::regex("\\]\\]\n"), "XXX_1");
-    ret = std::regex_replace(ret, std::regex("\\]\\]"), "XXX_2");
-
-    // Workaround for another bug that messes with the parser
-    // reported for 1.1.11g: https://www.lexaloffle.com/bbs/?tid=32155
-    ret = std::regex_replace(ret, std::regex("\\[\\[\\[\n"), "YYY_1");
-    ret = std::regex_replace(ret, std::regex("\\[\\[\\["), "YYY_2");
-    ret = std::regex_replace(ret, std::regex("\\[\\["), "YYY_3");
-
-    // Do the replacements described above
-    // Of course if the above workaround is used, we need to take care
-    // of the "[[\n" sequences we may have created.
-    ret = std::regex_replace(ret, std::regex("YYY_1"), "[]]..'[['..[[\n\n");
-    ret = std::regex_replace(ret, std::regex("YYY_2"), "[]]..'[['..[[");
-    ret = std::regex_replace(ret, std::regex("YYY_3"), "[]]..[[[");
-    // The newlines after "']]'" here are also required to avoid another bug,
-    // reported for 1.1.11g: https://www.lexaloffle.com/bbs/?tid=32148
-    ret = std::regex_replace(ret, std::regex("XXX_1"), "]]..']]'\n..[[\n\n");
-    ret = std::regex_replace(ret, std::regex("XXX_2"), "]]..']]'\n..[[");
+    while (digits.size() && digits.back() == '\n')
+        digits.pop_back();
+
+    // Emit the Lua long string in a single pass, escaping the sequences
+    // that PICO-8 chokes on even inside a string:
+    //  - "]]" freezes everything (fixed in 1.1.12, 10 chars wasted!)
+    //    https://www.lexaloffle.com/bbs/?tid=31673
+    //  - "[[" messes with the parser, reported for 1.1.11g
+    //    https://www.lexaloffle.com/bbs/?tid=32155
+    // Both are moved out of the long string, which is then reopened. The
+    // newline after "']]'" avoids yet another parser bug, reported for
+    // 1.1.11g: https://www.lexaloffle.com/bbs/?tid=32148
+    // When the next digit is a newline, a second one is needed because
+    // Lua ignores a newline right after an opening long bracket. This is
+    // also why we need an extra newline if the data starts with one.
+    std::string ret = "[[";
+    ret.reserve(digits.size() + digits.size() / 16 + 16);
+    if (digits.size() && digits[0] == '\n')
+        ret += '\n';
+
+    for (size_t i = 0; i < digits.size(); )
+    {
+        char const *s = digits.c_str() + i;
+        if (s[0] == ']' && s[1] == ']')
+        {
+            ret += "]]..']]'\n..[[";
+            i += 2;
+        }
+        else if (s[0] == '[' && s[1] == '[' && s[2] == '[')
+        {
+            ret += "[]]..'[['..[[";
+            i += 3;
+        }
+        else if (s[0] == '[' && s[1] == '[')
+        {
+            // The second "[" goes after the reopening bracket
+            ret += "[]]..[[[";
+            i += 2;
+            continue;
+        }
+        else
+        {
+            ret += s[0];
+            ++i;
+            continue;
+        }
+
+        if (i < digits.size() && digits[i] == '\n')
+            ret += '\n';
+    }
 
     // And finally, we cannot end with "]".
     if (ret.back() == ']')
-        return "[[" + ret + "]..']'";
+    {
+        ret.pop_back();
+        return ret + "]]..']'";
+    }
 
-    return "[[" + ret + "]]";
-#else
-    // If ]] appears in string we need to escape it with [=[...]=] and so on
-    std::string prefix;
+    return ret + "]]";
+}
 
-    while ((ret + "]").find("]" + prefix + "]") != std::string::npos)
-        prefix += "=";
+std::vector<uint8_t> decode59(std::string const &s, size_t size)
+{
+    int const n = 47;
+    int const p = 59;
 
-    return "[" + prefix + "[" + ret + "]" + prefix + "]";
-#endif
+    static int8_t const *lut = []()
+    {
+        static int8_t ret[256];
+        memset(ret, -1, sizeof(ret));
+        for (int i = 0; i < p; ++i)
+            ret[(uint8_t)base59[i]] = int8_t(i);
+        return ret;
+    }();
+
+    // Gather the digits from the concatenation of Lua strings
+    std::string digits;
+    digits.reserve(s.size());
+    for (size_t i = 0; i < s.size(); )
+    {
+        if (s.compare(i, 2, "[[") == 0)
+        {
+            i += 2;
+            if (i < s.size() && s[i] == '\n')
+                ++i;
+            size_t end = s.find("]]", i);
+            if (end == std::string::npos)
+                break;
+            digits.append(s, i, end - i);
+            i = end + 2;
+        }
+        else if (s[i] == '\'' || s[i] == '"')
+        {
+            size_t end = s.find(s[i], i + 1);
+            if (end == std::string::npos)
+                break;
+            digits.append(s, i + 1, end - i - 1);
+            i = end + 1;
+        }
+        else
+        {
+            // Skip concatenation operators and whitespace
+            ++i;
+        }
+    }
+
+    // Missing digits at the end were newlines, i.e. zeroes
+    std::vector<uint8_t> ret;
+    ret.reserve((digits.size() + 7) / 8 * n / 8 + 8);
+    bit_writer bw(ret);
+    for (size_t i = 0; i < digits.size(); i += 8)
+    {
+        uint64_t val = 0;
+        for (size_t j = std::min(digits.size(), i + 8); j-- > i; )
+            val = val * p + std::max(0, (int)lut[(uint8_t)digits[j]]);
+        bw.put(uint32_t(val & 0xffffff), 24);
+        bw.put(uint32_t(val >> 24), n - 24);
+    }
+    bw.flush();
+
+    ret.resize(size);
+    return ret;
+}
+
+bool unz8(std::string const &s, std::vector<uint32_t> &out)
+{
+    // Each group of 8 digits holds at most 6 bytes; any extra zero
+    // padding is ignored by the decompressor.
+    std::vector<uint8_t> data = decode59(s, s.size() / 8 * 6 + 6), bytes;
+    if (!inflate_gz8(data.data(), data.size(), bytes))
+        return false;
+
+    out.assign((bytes.size() + 3) / 4, 0);
+    for (size_t i = 0; i < bytes.size(); ++i)
+        out[i / 4] |= uint32_t(bytes[i]) << (i % 4 * 8);
+    return true;
 }
 
 std::vector<uint8_t> compress(std::vector<uint8_t> &input)
@@ -20,7 +20,15 @@ namespace z8
 {
 
 std::vector<uint8_t> compress(std::vector<uint8_t> &input);
+
+// Encode binary data as a Lua expression made of strings of base 59
+// digits, and decode it back to size bytes
 std::string encode59(std::vector<uint8_t> const &v);
+std::vector<uint8_t> decode59(std::string const &s, size_t size);
+
+// Decompress base 59 data like unz8() does in PICO-8: the bytes are packed
+// into little-endian 32-bit numbers. Returns false if the data is invalid.
+bool unz8(std::string const &s, std::vector<uint32_t> &out);
 
 } // namespace z8
 
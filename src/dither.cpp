@@ -17,6 +17,14 @@
 #include <string>
 #include <vector>
 #include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <cmath>
+#include <filesystem>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
 
 #include <lol/engine.h>
 
@@ -26,188 +34,566 @@
 
 #define DEPTH 512
 
+namespace fs = std::filesystem;
+
 namespace z8
 {
 
-void dither(char const *src, char const *out, bool hicolor, bool error_diffusion)
+// Nearest colour search. The RGB cube is split into cells, and each cell
+// lists the only palette entries that can be closest to a point inside
+// it: those whose distance to the cell is not larger than the farthest
+// point of the cell from some other entry. Points outside the cube use a
+// brute force search.
+class nearest_color
 {
+public:
+    nearest_color(std::vector<lol::vec3> const &colors)
+      : m_colors(colors),
+        m_first(cells * cells * cells + 1)
+    {
+        std::vector<float> min_dist(colors.size());
+        for (int n = 0; n < cells * cells * cells; ++n)
+        {
+            lol::vec3 lo = lol::vec3(float(n % cells), float(n / cells % cells),
+                                     float(n / cells / cells)) / float(cells);
+            lol::vec3 hi = lo + lol::vec3(1.f / cells);
 
-    std::vector<lol::vec3> colors;
-    std::vector<uint8_t> indices;
+            float max_dist = FLT_MAX;
+            for (int i = 0; i < (int)colors.size(); ++i)
+            {
+                lol::vec3 const &c = colors[i];
+                lol::vec3 inner = lol::max(lol::max(lo - c, c - hi), lol::vec3(0.f));
+                lol::vec3 outer = lol::max(lol::abs(c - lo), lol::abs(c - hi));
+                min_dist[i] = lol::dot(inner, inner);
+                max_dist = lol::min(max_dist, lol::dot(outer, outer));
+            }
 
-    for (int i = 0; i < 16; ++i)
-        colors.push_back(pico8::palette::get(i).rgb);
+            m_first[n] = (uint32_t)m_candidates.size();
+            for (int i = 0; i < (int)colors.size(); ++i)
+                if (min_dist[i] <= max_dist)
+                    m_candidates.push_back(uint8_t(i));
+        }
+        m_first[cells * cells * cells] = (uint32_t)m_candidates.size();
 
-    // Fix gamma (kinda)
-    for (auto &color : colors)
-        color *= color;
+        for (int i = 0; i < (int)colors.size(); ++i)
+            m_all.push_back(uint8_t(i));
+    }
 
-    if (hicolor)
+    int operator()(lol::vec3 color) const
     {
-        // Add colour combinations that aren’t too awful
-        for (int i = 0; i < 16; ++i)
-            for (int j = i + 1; j < 16; ++j)
-                if (distance(colors[i], colors[j]) < 0.8f)
-                {
-                    colors.push_back(0.5f * (colors[i] + colors[j]));
-                    indices.push_back(i * 16 + j);
-                }
+        uint8_t const *first = m_all.data(), *last = first + m_all.size();
+        if (color.x >= 0.f && color.x < 1.f && color.y >= 0.f && color.y < 1.f
+             && color.z >= 0.f && color.z < 1.f)
+        {
+            lol::ivec3 cell(color * float(cells));
+            int n = (cell.z * cells + cell.y) * cells + cell.x;
+            first = m_candidates.data() + m_first[n];
+            last = m_candidates.data() + m_first[n + 1];
+        }
+
+        int best = *first;
+        float best_dist = sqdist(best, color);
+        while (++first < last)
+        {
+            float dist = sqdist(*first, color);
+            if (dist < best_dist)
+            {
+                best = *first;
+                best_dist = dist;
+            }
+        }
+        return best;
     }
 
-#if 0
-    for (int i = 0; i < 16; ++i)
+private:
+    float sqdist(int i, lol::vec3 color) const
     {
-    printf("  d: %02x %02x %02x  f: %f %f %f\n",
-       pico8::palette::get8(i).r,
-       pico8::palette::get8(i).g,
-       pico8::palette::get8(i).b,
-       pico8::palette::get(i).r,
-       pico8::palette::get(i).g,
-       pico8::palette::get(i).b);
+        lol::vec3 delta = m_colors[i] - color;
+        return lol::dot(delta, delta);
     }
-#endif
 
-    /* Load images */
-    lol::image im;
-    im.load(src);
+    static constexpr int cells = 32;
 
-    lol::ivec2 size(im.size());
+    std::vector<lol::vec3> const &m_colors;
+    std::vector<uint32_t> m_first;
+    std::vector<uint8_t> m_candidates, m_all;
+};
 
-#if 0
-    if (size.x != desired_width || size.y != desired_height)
+// Fixed-capacity cache of ordered dithering tables, indexed by 24-bit
+// colour and using open addressing. When all the slots near a colour’s
+// hash are taken, the first of them is evicted.
+class lut_cache
+{
+public:
+    lut_cache()
+      : m_keys(capacity, empty),
+        m_luts(capacity * DEPTH)
+    {}
+
+    // Return the table for key, calling fill() to build it if necessary
+    template<typename F>
+    uint8_t const *get(uint32_t key, F const &fill)
     {
-        size.x = desired_width;
-        size.y = desired_height;
-        im = im.Resize(size, lol::ResampleAlgorithm::Bicubic);
+        size_t const hash = key * 0x9e3779b1u >> (32 - capacity_bits);
+        size_t slot = hash;
+        for (size_t k = 0; k < max_probe; ++k)
+        {
+            size_t i = (hash + k) & (capacity - 1);
+            if (m_keys[i] == key)
+                return &m_luts[i * DEPTH];
+            if (m_keys[i] == empty)
+            {
+                slot = i;
+                break;
+            }
+        }
+
+        m_keys[slot] = key;
+        fill(&m_luts[slot * DEPTH]);
+        return &m_luts[slot * DEPTH];
     }
-#endif
 
-    // Slight blur
-//    im = im.Resize(size * 2, ResampleAlgorithm::Bicubic)
-//           .Resize(size, ResampleAlgorithm::Bresenham);
+private:
+    static constexpr int capacity_bits = 12;
+    static constexpr size_t capacity = size_t(1) << capacity_bits;
+    static constexpr size_t max_probe = 16;
+    static constexpr uint32_t empty = ~uint32_t(0);
 
-    lol::msg::info("image size %d×%d\n", size.x, size.y);
+    std::vector<uint32_t> m_keys;
+    std::vector<uint8_t> m_luts;
+};
 
-    lol::image dst(size);
-    std::vector<uint8_t> pixels;
+// Everything that does not depend on the dithered image
+struct dither_context
+{
+    dither_context(bool hicolor_)
+      : hicolor(hicolor_)
+    {
+        for (int i = 0; i < 16; ++i)
+            colors.push_back(pico8::palette::get(i).rgb);
 
-    //auto kernel = lol::image::kernel::halftone(lol::ivec2(6));
-    //auto kernel = lol::image::kernel::blue_noise(lol::ivec2(64));
-    auto kernel = lol::image::kernel::bayer(lol::ivec2(32));
+        // Fix gamma (kinda)
+        for (auto &color : colors)
+            color *= color;
 
-    auto closest = [& colors](lol::vec3 color) -> int
-    {
-        float best_dist = FLT_MAX;
-        int best = -1;
-        for (int i = 0; i < (int)colors.size(); ++i)
+        if (hicolor)
         {
-            float dist = lol::distance(colors[i], color);
-            if (dist < best_dist)
-            {
-                best = i;
-                best_dist = dist;
-            }
+            // Add colour combinations that aren’t too awful
+            for (int i = 0; i < 16; ++i)
+                for (int j = i + 1; j < 16; ++j)
+                    if (distance(colors[i], colors[j]) < 0.8f)
+                    {
+                        colors.push_back(0.5f * (colors[i] + colors[j]));
+                        indices.push_back(i * 16 + j);
+                    }
         }
 
-        return best;
+#if 0
+        for (int i = 0; i < 16; ++i)
+        {
+        printf("  d: %02x %02x %02x  f: %f %f %f\n",
+           pico8::palette::get8(i).r,
+           pico8::palette::get8(i).g,
+           pico8::palette::get8(i).b,
+           pico8::palette::get(i).r,
+           pico8::palette::get(i).g,
+           pico8::palette::get(i).b);
+        }
+#endif
+
+        //kernel = lol::image::kernel::halftone(lol::ivec2(6));
+        //kernel = lol::image::kernel::blue_noise(lol::ivec2(64));
+        kernel = lol::image::kernel::bayer(lol::ivec2(32));
+
+        closest = std::make_unique<nearest_color>(colors);
+
+        // Palette entries by decreasing luminance, for sorting the tables
+        for (int i = 0; i < (int)colors.size(); ++i)
+            order.push_back(i);
+        std::stable_sort(order.begin(), order.end(), [this](int a, int b)
+        {
+            return lol::dot(colors[a] - colors[b], lol::vec3(1)) > 0;
+        });
+    }
+
+    float threshold(int i, int j) const
+    {
+        return kernel[i % kernel.size().x][j % kernel.size().y];
+    }
+
+    bool hicolor;
+    std::vector<lol::vec3> colors;
+    std::vector<uint8_t> indices;
+    std::vector<int> order;
+    lol::array2d<float> kernel;
+    std::unique_ptr<nearest_color> closest;
+};
+
+// Run job(i, luts) for i in [0, count) on all available cores, with one
+// table cache per thread
+static void parallel_for(int count, std::function<void(int, lut_cache &)> const &job)
+{
+    std::atomic<int> next(0);
+
+    auto worker = [&]()
+    {
+        lut_cache luts;
+        for (int i; (i = next++) < count; )
+            job(i, luts);
     };
 
-    std::map<uint32_t, int[DEPTH]> luts;
+    std::vector<std::thread> threads;
+    int const nthreads = lol::max(1, lol::min(count, (int)std::thread::hardware_concurrency()));
+    for (int i = 0; i < nthreads; ++i)
+        threads.push_back(std::thread(worker));
+    for (auto &t : threads)
+        t.join();
+}
 
-    /* Dither image for first destination */
-    lol::array2d<lol::vec4> &curdata = im.lock2d<lol::PixelFormat::RGBA_F32>();
-    lol::array2d<lol::vec4> &dstdata = dst.lock2d<lol::PixelFormat::RGBA_F32>();
-    for (int j = 0; j < size.y; ++j)
+// Ordered dithering of rows [j0, j1) of an image
+static void dither_rows(dither_context const &ctx, lut_cache &luts,
+                        lol::array2d<lol::vec4> const &data,
+                        int j0, int j1, uint8_t *pixels)
+{
+    lol::ivec2 size = data.size();
+
+    for (int j = j0; j < j1; ++j)
     {
         for (int i = 0; i < size.x; ++i)
         {
-            lol::vec3 pixel = curdata[i][j].rgb;
-            uint8_t nearest = 0;
+            lol::vec3 pixel = data[i][j].rgb;
+            uint32_t key = lol::dot(lol::ivec3(pixel * 255.99f), lol::ivec3(0x1, 0x100, 0x10000));
 
-            if (error_diffusion)
+            uint8_t const *found = luts.get(key, [&](uint8_t *lut)
             {
-                nearest = closest(pixel);
-                auto error = lol::vec4(pixel - colors[nearest], 0.f) / 18.f;
-                if (i < size.x - 1)
-                    curdata[i + 1][j] += 7.f * error;
-                if (j < size.y - 1)
+                // Dither the colour DEPTH times with error diffusion,
+                // starting from the quantised value so that the table
+                // does not depend on which pixel built it first.
+                int count[256] = {};
+                auto color = lol::vec3(lol::ivec3(key & 0xff, (key >> 8) & 0xff,
+                                                  key >> 16)) / 255.f;
+                auto candidate = color;
+                for (int n = 0; n < DEPTH; ++n)
                 {
-                    if (i > 0)
-                        curdata[i - 1][j + 1] += 1.f * error;
-                    curdata[i][j + 1] += 5.f * error;
-                    if (i < size.x - 1)
-                        curdata[i + 1][j + 1] += 3.f * error;
+                    int k = (*ctx.closest)(candidate);
+                    ++count[k];
+                    candidate = color + 7.f / 16 * (candidate - ctx.colors[k]);
                 }
-            }
-            else
-            {
-                uint32_t key = lol::dot(lol::ivec3(pixel * 255.99f), lol::ivec3(0x1, 0x100, 0x10000));
 
-                if (luts.find(key) == luts.end())
-                {
-                    // Dither pixel DEPTH times with error diffusion
-                    int buffer[DEPTH];
-                    auto candidate = pixel;
-                    for (int n = 0; n < DEPTH; ++n)
-                    {
-                        buffer[n] = closest(candidate);
-                        candidate = pixel + 7.f / 16 * (candidate - colors[buffer[n]]);
-                    }
+                // Sort results by luminance
+                for (int k : ctx.order)
+                    lut = std::fill_n(lut, count[k], uint8_t(k));
+            });
 
-                    // Sort results by luminance
-                    std::sort(buffer, buffer + DEPTH, [& colors](int a, int b)
-                    {
-                        return lol::dot(colors[a] - colors[b], lol::vec3(1)) > 0;
-                    });
-                    memcpy(luts[key], buffer, sizeof(buffer));
-                }
+            // Pick the final color using a dithering kernel
+            *pixels++ = found[(int)(ctx.threshold(i, j) * DEPTH)];
+        }
+    }
+}
+
+// Error diffusion of a whole image. When dithering animations, the error
+// buffer is seeded with the same small pattern for every frame, so that
+// static or slowly changing areas settle on the same choices instead of
+// flickering with each tiny change upstream.
+static void diffuse(dither_context const &ctx, lol::array2d<lol::vec4> &data,
+                    bool seeded, uint8_t *pixels)
+{
+    lol::ivec2 size = data.size();
 
-                // Pick the final color using a dithering kernel
-                int *found = luts[key];
-                nearest = found[(int)(kernel[i % kernel.size().x][j % kernel.size().y] * DEPTH)];
+    if (seeded)
+        for (int j = 0; j < size.y; ++j)
+            for (int i = 0; i < size.x; ++i)
+                data[i][j] += lol::vec4(lol::vec3(ctx.threshold(i, j) - 0.5f) / 32.f, 0.f);
+
+    for (int j = 0; j < size.y; ++j)
+    {
+        for (int i = 0; i < size.x; ++i)
+        {
+            lol::vec3 pixel = data[i][j].rgb;
+            uint8_t nearest = (*ctx.closest)(pixel);
+            auto error = lol::vec4(pixel - ctx.colors[nearest], 0.f) / 18.f;
+            if (i < size.x - 1)
+                data[i + 1][j] += 7.f * error;
+            if (j < size.y - 1)
+            {
+                if (i > 0)
+                    data[i - 1][j + 1] += 1.f * error;
+                data[i][j + 1] += 5.f * error;
+                if (i < size.x - 1)
+                    data[i + 1][j + 1] += 3.f * error;
             }
 
-            pixels.push_back(nearest);
+            *pixels++ = nearest;
         }
     }
+}
 
-    im.unlock2d(curdata);
-    dst.unlock2d(dstdata);
-
-#if 0
-    /* Save image */
-    //dst = dst.Resize(size * 4, ResampleAlgorithm::Bresenham);
-    dst.save(argv[4]);
-#endif
+// Pack dithered pixels to 4 bits per pixel; high colour images are
+// stored as two consecutive screens that are meant to alternate.
+static std::vector<uint8_t> pack(dither_context const &ctx, lol::ivec2 size,
+                                 std::vector<uint8_t> const &pixels)
+{
+    // Rows of odd width are padded with colour 0
+    int const pitch = (size.x + 1) / 2;
 
     std::vector<uint8_t> rawdata;
-    rawdata.resize(hicolor ? pixels.size() : pixels.size() / 2);
+    rawdata.resize(pitch * size.y * (ctx.hicolor ? 2 : 1));
     for (int j = 0; j < size.y; ++j)
         for (int i = 0; i < size.x; i += 2)
         {
-            uint8_t c1 = pixels[j * 128 + i];
-            uint8_t c2 = pixels[j * 128 + i + 1];
-            if (hicolor)
+            uint8_t c1 = pixels[j * size.x + i];
+            uint8_t c2 = i + 1 < size.x ? pixels[j * size.x + i + 1] : 0;
+            if (ctx.hicolor)
             {
                 int d = (j + i / 2) & 1;
-                uint8_t a1 = c1 < 16 ? c1 : (indices[c1 - 16] << (4 * d) >> 4) & 0xf;
-                uint8_t a2 = c2 < 16 ? c2 : (indices[c2 - 16] << (4 * d) >> 4) & 0xf;
-                uint8_t b1 = c1 < 16 ? c1 : (indices[c1 - 16] >> (4 * d)) & 0xf;
-                uint8_t b2 = c2 < 16 ? c2 : (indices[c2 - 16] >> (4 * d)) & 0xf;
-                rawdata[j * 64 + i / 2] = a2 * 16 + a1;
-                rawdata[(j + size.x) * 64 + i / 2] = b2 * 16 + b1;
+                uint8_t a1 = c1 < 16 ? c1 : (ctx.indices[c1 - 16] << (4 * d) >> 4) & 0xf;
+                uint8_t a2 = c2 < 16 ? c2 : (ctx.indices[c2 - 16] << (4 * d) >> 4) & 0xf;
+                uint8_t b1 = c1 < 16 ? c1 : (ctx.indices[c1 - 16] >> (4 * d)) & 0xf;
+                uint8_t b2 = c2 < 16 ? c2 : (ctx.indices[c2 - 16] >> (4 * d)) & 0xf;
+                rawdata[j * pitch + i / 2] = a2 * 16 + a1;
+                rawdata[(j + size.y) * pitch + i / 2] = b2 * 16 + b1;
             }
             else
             {
-                rawdata[j * 64 + i / 2] = c2 * 16 + c1;
+                rawdata[j * pitch + i / 2] = c2 * 16 + c1;
+            }
+        }
+
+    return rawdata;
+}
+
+static float lanczos3(float x)
+{
+    x = std::fabs(x);
+    if (x < 1e-5f)
+        return 1.f;
+    if (x >= 3.f)
+        return 0.f;
+    float const px = float(lol::D_PI) * x;
+    return 3.f * std::sin(px) * std::sin(px / 3.f) / (px * px);
+}
+
+// Normalised Lanczos-3 weights for each destination pixel along one axis.
+// When shrinking, the filter is stretched so that it also averages.
+struct filter_taps
+{
+    filter_taps(int src, int dst)
+      : first(dst), count(dst)
+    {
+        float const scale = float(src) / dst;
+        float const stretch = lol::max(1.f, scale);
+        float const support = 3.f * stretch;
+
+        for (int o = 0; o < dst; ++o)
+        {
+            float const center = (o + 0.5f) * scale;
+            int const lo = (int)std::floor(center - support);
+            int const hi = (int)std::ceil(center + support);
+
+            // Pixels past the edges are clamped, so fold their weights
+            // into the edge pixels
+            first[o] = lol::clamp(lo, 0, src - 1);
+            count[o] = lol::clamp(hi, 0, src - 1) - first[o] + 1;
+            size_t const start = weights.size();
+            weights.resize(start + count[o], 0.f);
+
+            float total = 0.f;
+            for (int k = lo; k <= hi; ++k)
+            {
+                float w = lanczos3((k + 0.5f - center) / stretch);
+                weights[start + lol::clamp(k, 0, src - 1) - first[o]] += w;
+                total += w;
+            }
+            for (size_t k = start; k < weights.size(); ++k)
+                weights[k] /= total;
+        }
+    }
+
+    std::vector<int> first, count;
+    std::vector<float> weights;
+};
+
+// Separable resampling: rows first, then columns. Each tap is applied to
+// whole RGBA pixels at once, which compilers turn into vector code.
+static lol::image resample(lol::image &im, lol::ivec2 size)
+{
+    lol::ivec2 const src_size(im.size());
+    filter_taps const tx(src_size.x, size.x), ty(src_size.y, size.y);
+
+    lol::array2d<lol::vec4> tmp(lol::ivec2(size.x, src_size.y));
+    auto &src = im.lock2d<lol::PixelFormat::RGBA_F32>();
+    for (int j = 0; j < src_size.y; ++j)
+        for (int i = 0, n = 0; i < size.x; n += tx.count[i++])
+        {
+            lol::vec4 sum(0.f);
+            for (int k = 0; k < tx.count[i]; ++k)
+                sum += tx.weights[n + k] * src[tx.first[i] + k][j];
+            tmp[i][j] = sum;
+        }
+    im.unlock2d(src);
+
+    // Lanczos overshoots a little, so clamp the result to valid colours
+    lol::image ret(size);
+    auto &dst = ret.lock2d<lol::PixelFormat::RGBA_F32>();
+    for (int j = 0, n = 0; j < size.y; n += ty.count[j++])
+        for (int i = 0; i < size.x; ++i)
+        {
+            lol::vec4 sum(0.f);
+            for (int k = 0; k < ty.count[j]; ++k)
+                sum += ty.weights[n + k] * tmp[i][ty.first[j] + k];
+            dst[i][j] = lol::clamp(sum, 0.f, 1.f);
+        }
+    ret.unlock2d(dst);
+
+    return ret;
+}
+
+static lol::image load_image(char const *src, lol::ivec2 size)
+{
+    lol::image im;
+    im.load(src);
+
+    lol::ivec2 const src_size(im.size());
+    if (src_size.x > 0 && src_size.y > 0 && (src_size.x != size.x || src_size.y != size.y))
+        im = resample(im, size);
+
+    // Slight blur
+//    im = im.Resize(size * 2, ResampleAlgorithm::Bicubic)
+//           .Resize(size, ResampleAlgorithm::Bresenham);
+
+    return im;
+}
+
+// Extensions of the image formats that may make up a frame sequence
+static bool is_image_file(fs::path const &path)
+{
+    std::string ext = path.extension().string();
+    std::transform(ext.begin(), ext.end(), ext.begin(),
+                   [](unsigned char ch) { return (char)std::tolower(ch); });
+    for (char const *known : { ".png", ".jpg", ".jpeg", ".bmp", ".gif", ".tga" })
+        if (ext == known)
+            return true;
+    return false;
+}
+
+bool dither(char const *src, char const *out, bool hicolor, bool error_diffusion,
+            lol::ivec2 size)
+{
+    dither_context const ctx(hicolor);
+    std::vector<std::vector<uint8_t>> frames;
+
+    std::error_code ec;
+    if (fs::is_directory(src, ec))
+    {
+        // Dither an image sequence, one frame per thread. Only files with
+        // an image extension are frames, so that stray files such as
+        // .DS_Store or a README do not break the numbering.
+        std::vector<fs::path> files;
+        for (auto const &entry : fs::directory_iterator(src, ec))
+        {
+            if (!entry.is_regular_file(ec))
+                continue;
+            if (is_image_file(entry.path()))
+                files.push_back(entry.path());
+            else
+                lol::msg::warn("skipping %s\n", entry.path().string().c_str());
+        }
+        std::sort(files.begin(), files.end());
+
+        // lol::image and its codecs make no thread-safety promise, so
+        // frames are loaded, resampled and copied out under a lock, and
+        // only the dithering itself runs in parallel.
+        std::mutex image_mutex;
+
+        // A missing frame would shift all the following ones in the
+        // output stream, so any failure aborts the whole sequence.
+        std::atomic<int> failures(0);
+        frames.resize(files.size());
+        parallel_for((int)files.size(), [&](int n, lut_cache &luts)
+        {
+            lol::array2d<lol::vec4> data;
+            {
+                std::lock_guard<std::mutex> lock(image_mutex);
+                lol::image im = load_image(files[n].string().c_str(), size);
+                if (im.size().x == size.x && im.size().y == size.y)
+                {
+                    auto &locked = im.lock2d<lol::PixelFormat::RGBA_F32>();
+                    data = locked;
+                    im.unlock2d(locked);
+                }
             }
+
+            if (data.size().x != size.x || data.size().y != size.y)
+            {
+                lol::msg::error("could not load %s\n", files[n].string().c_str());
+                ++failures;
+                return;
+            }
+
+            std::vector<uint8_t> pixels(size.x * size.y);
+
+            if (error_diffusion)
+                diffuse(ctx, data, true, pixels.data());
+            else
+                dither_rows(ctx, luts, data, 0, size.y, pixels.data());
+
+            frames[n] = pack(ctx, size, pixels);
+        });
+
+        if (failures)
+        {
+            lol::msg::error("%d of %d frames could not be loaded\n",
+                            (int)failures, (int)frames.size());
+            return false;
+        }
+
+        lol::msg::info("dithered %d frames\n", (int)frames.size());
+    }
+    else
+    {
+        lol::image im = load_image(src, size);
+        if (im.size().x != size.x || im.size().y != size.y)
+        {
+            lol::msg::error("could not load %s\n", src);
+            return false;
+        }
+        lol::msg::info("image size %d×%d\n", size.x, size.y);
+
+        std::vector<uint8_t> pixels(size.x * size.y);
+
+        auto &data = im.lock2d<lol::PixelFormat::RGBA_F32>();
+        if (error_diffusion)
+        {
+            diffuse(ctx, data, false, pixels.data());
+        }
+        else
+        {
+            // Rows are independent with ordered dithering
+            int const rows = 8;
+            parallel_for((size.y + rows - 1) / rows, [&](int n, lut_cache &luts)
+            {
+                int j0 = n * rows, j1 = lol::min(j0 + rows, size.y);
+                dither_rows(ctx, luts, data, j0, j1, pixels.data() + j0 * size.x);
+            });
         }
+        im.unlock2d(data);
+
+        frames.push_back(pack(ctx, size, pixels));
+    }
 
     /* Save data */
     FILE *s = out ? fopen(out, "wb+") : stdout;
-    fwrite(rawdata.data(), 1, rawdata.size(), s);
+    if (!s)
+    {
+        lol::msg::error("could not open %s for writing\n", out);
+        return false;
+    }
+    for (auto const &rawdata : frames)
+        fwrite(rawdata.data(), 1, rawdata.size(), s);
     if (out)
         fclose(s);
+
+    return true;
 }
 
 } // namespace z8
@@ -17,7 +17,11 @@
 namespace z8
 {
 
-void dither(char const *src, char const *out, bool hicolor, bool error_diffusion);
+// Dither an image, or a directory of frames, to the PICO-8 palette after
+// resampling to the given size, and write packed 4bpp data to out. Returns
+// false, without writing anything, if any image could not be loaded.
+bool dither(char const *src, char const *out, bool hicolor, bool error_diffusion,
+            lol::ivec2 size = lol::ivec2(128));
 
 } // namespace z8
 
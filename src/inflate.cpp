@@ -0,0 +1,360 @@
+//
+//  ZEPTO-8 — Fantasy console emulator
+//
+//  Copyright © 2016—2020 Sam Hocevar <sam@hocevar.net>
+//
+//  This program is free software. It comes without any warranty, to
+//  the extent permitted by applicable law. You can redistribute it
+//  and/or modify it under the terms of the Do What the Fuck You Want
+//  to Public License, Version 2, as published by the WTFPL Task Force.
+//  See http://www.wtfpl.net/ for more details.
+//
+
+#if HAVE_CONFIG_H
+#   include "config.h"
+#endif
+
+#include "inflate.h"
+#include "bits.h"
+
+// A small deflate decoder
+// ———————————————————————
+// Huffman codes are decoded with a lookup table on the first few bits,
+// falling back to a canonical bit-by-bit decode for longer codes, in
+// the spirit of Mark Adler’s puff.c. It also reads the GZ8 dialect that
+// z8tool --compress emits for unz8.
+
+namespace z8
+{
+
+namespace
+{
+
+struct huffman
+{
+    static int const fast_bits = 9;
+
+    bool build(uint8_t const *lengths, int n)
+    {
+        int offsets[16];
+
+        for (int len = 0; len < 16; ++len)
+            m_count[len] = 0;
+        for (int i = 0; i < n; ++i)
+            ++m_count[lengths[i]];
+        m_count[0] = 0;
+
+        // Reject over-subscribed codes; incomplete codes are allowed
+        int left = 1;
+        for (int len = 1; len < 16; ++len)
+        {
+            left = left * 2 - m_count[len];
+            if (left < 0)
+                return false;
+        }
+
+        offsets[1] = 0;
+        for (int len = 1; len < 15; ++len)
+            offsets[len + 1] = offsets[len] + m_count[len];
+        for (int i = 0; i < n; ++i)
+            if (lengths[i])
+                m_symbol[offsets[lengths[i]]++] = uint16_t(i);
+
+        // Fill the fast table with the bit-reversed short codes
+        for (auto &entry : m_fast)
+            entry = 0;
+        for (int len = 1, code = 0, index = 0; len <= fast_bits; ++len, code <<= 1)
+        {
+            for (int k = 0; k < m_count[len]; ++k, ++code, ++index)
+            {
+                int rev = 0;
+                for (int b = 0; b < len; ++b)
+                    rev |= ((code >> b) & 1) << (len - 1 - b);
+                for (int i = rev; i < (1 << fast_bits); i += 1 << len)
+                    m_fast[i] = uint16_t((m_symbol[index] << 4) | len);
+            }
+        }
+
+        return true;
+    }
+
+    int decode(bit_reader &br) const
+    {
+        uint16_t entry = m_fast[br.peek(fast_bits)];
+        if (entry)
+        {
+            br.skip(entry & 0xf);
+            return entry >> 4;
+        }
+
+        // Slow path for long codes
+        for (int len = 1, code = 0, first = 0, index = 0; len < 16; ++len)
+        {
+            code |= br.get(1);
+            int count = m_count[len];
+            if (code - count < first)
+                return m_symbol[index + (code - first)];
+            index += count;
+            first = (first + count) << 1;
+            code <<= 1;
+        }
+
+        return -1;
+    }
+
+private:
+    uint16_t m_fast[1 << fast_bits];
+    uint16_t m_count[16];
+    uint16_t m_symbol[288];
+};
+
+uint16_t const length_base[] =
+{
+    3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+    35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258,
+};
+
+uint8_t const length_extra[] =
+{
+    0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+    3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0,
+};
+
+uint16_t const dist_base[] =
+{
+    1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+    257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145,
+    8193, 12289, 16385, 24577,
+};
+
+uint8_t const dist_extra[] =
+{
+    0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+    7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13,
+};
+
+// Output starts at out[start] and may not grow past max_size bytes
+bool inflate_codes(bit_reader &br, huffman const &lit, huffman const &dist,
+                   std::vector<uint8_t> &out, size_t start, size_t max_size)
+{
+    for (;;)
+    {
+        int sym = lit.decode(br);
+        if (sym < 0 || br.overrun())
+            return false;
+
+        if (sym < 256)
+        {
+            if (out.size() - start >= max_size)
+                return false;
+            out.push_back(uint8_t(sym));
+        }
+        else if (sym == 256)
+        {
+            return true;
+        }
+        else
+        {
+            sym -= 257;
+            if (sym >= 29)
+                return false;
+            int len = length_base[sym] + br.get(length_extra[sym]);
+
+            int dsym = dist.decode(br);
+            if (dsym < 0 || dsym >= 30)
+                return false;
+            size_t d = dist_base[dsym] + br.get(dist_extra[dsym]);
+            if (d > out.size() - start
+                 || size_t(len) > max_size - (out.size() - start))
+                return false;
+
+            // Copies may overlap, so go byte by byte
+            size_t from = out.size() - d;
+            for (int i = 0; i < len; ++i)
+                out.push_back(out[from + i]);
+        }
+    }
+}
+
+bool inflate_fixed(bit_reader &br, std::vector<uint8_t> &out, size_t start,
+                   size_t max_size)
+{
+    static huffman lit, dist;
+    static bool init = [&]()
+    {
+        uint8_t lengths[288];
+        for (int i = 0; i < 288; ++i)
+            lengths[i] = i < 144 ? 8 : i < 256 ? 9 : i < 280 ? 7 : 8;
+        lit.build(lengths, 288);
+        for (int i = 0; i < 30; ++i)
+            lengths[i] = 5;
+        dist.build(lengths, 30);
+        return true;
+    }();
+    (void)init;
+
+    return inflate_codes(br, lit, dist, out, start, max_size);
+}
+
+// Read count code lengths; repeat codes may not go past the end
+bool inflate_lengths(bit_reader &br, huffman const &lencode, uint8_t *lengths,
+                     int count)
+{
+    for (int i = 0; i < count; )
+    {
+        int sym = lencode.decode(br);
+        if (sym < 0 || br.overrun())
+            return false;
+
+        if (sym < 16)
+        {
+            lengths[i++] = uint8_t(sym);
+            continue;
+        }
+
+        uint8_t len = 0;
+        int repeat;
+        if (sym == 16)
+        {
+            if (i == 0)
+                return false;
+            len = lengths[i - 1];
+            repeat = 3 + br.get(2);
+        }
+        else
+            repeat = sym == 17 ? 3 + br.get(3) : 11 + br.get(7);
+
+        if (i + repeat > count)
+            return false;
+        while (repeat--)
+            lengths[i++] = len;
+    }
+
+    return true;
+}
+
+// In the GZ8 dialect, code length code lengths are stored in natural
+// order, and literal and distance code lengths are two separate runs.
+bool inflate_dynamic(bit_reader &br, std::vector<uint8_t> &out, size_t start,
+                     size_t max_size, bool gz8)
+{
+    static uint8_t const order[19] =
+    {
+        16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15,
+    };
+    static uint8_t const gz8_order[19] =
+    {
+        16, 17, 18, 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15,
+    };
+
+    int nlen = br.get(5) + 257;
+    int ndist = br.get(5) + 1;
+    int ncode = br.get(4) + 4;
+    if (nlen > 286 || ndist > 30)
+        return false;
+
+    uint8_t lengths[286 + 30] = { 0 };
+    for (int i = 0; i < ncode; ++i)
+        lengths[(gz8 ? gz8_order : order)[i]] = uint8_t(br.get(3));
+
+    huffman lencode, lit, dist;
+    if (!lencode.build(lengths, 19))
+        return false;
+
+    if (gz8)
+    {
+        if (!inflate_lengths(br, lencode, lengths, nlen)
+             || !inflate_lengths(br, lencode, lengths + nlen, ndist))
+            return false;
+    }
+    else if (!inflate_lengths(br, lencode, lengths, nlen + ndist))
+        return false;
+
+    // The end-of-block code is mandatory
+    if (lengths[256] == 0)
+        return false;
+
+    if (!lit.build(lengths, nlen) || !dist.build(lengths + nlen, ndist))
+        return false;
+
+    return inflate_codes(br, lit, dist, out, start, max_size);
+}
+
+} // anonymous namespace
+
+bool inflate(uint8_t const *data, size_t size, std::vector<uint8_t> &out,
+             size_t max_size)
+{
+    // Check the zlib header: deflate method, no preset dictionary
+    if (size < 2 || (data[0] & 0xf) != 8 || (data[0] * 256 + data[1]) % 31
+         || (data[1] & 0x20))
+        return false;
+
+    bit_reader br(data + 2, size - 2);
+    size_t const start = out.size();
+
+    for (bool last = false; !last; )
+    {
+        last = br.get(1);
+        switch (br.get(2))
+        {
+        case 0:
+        {
+            br.align();
+            uint32_t len = br.get(16);
+            if ((br.get(16) ^ 0xffff) != len || len > max_size - (out.size() - start))
+                return false;
+            while (len--)
+                out.push_back(uint8_t(br.get(8)));
+            break;
+        }
+        case 1:
+            if (!inflate_fixed(br, out, start, max_size))
+                return false;
+            break;
+        case 2:
+            if (!inflate_dynamic(br, out, start, max_size, false))
+                return false;
+            break;
+        default:
+            return false;
+        }
+
+        if (br.overrun())
+            return false;
+    }
+
+    // The Adler-32 checksum is not verified
+    return true;
+}
+
+bool inflate_gz8(uint8_t const *data, size_t size, std::vector<uint8_t> &out)
+{
+    bit_reader br(data, size);
+    size_t const start = out.size();
+
+    for (;;)
+    {
+        bool ok = true;
+        if (!br.get(1))
+        {
+            if (!br.get(1))
+                return true;
+
+            // Stored blocks are neither aligned nor checked
+            uint32_t len = br.get(16);
+            while (len--)
+                out.push_back(uint8_t(br.get(8)));
+        }
+        else if (!br.get(1))
+            ok = inflate_fixed(br, out, start, SIZE_MAX);
+        else
+            ok = inflate_dynamic(br, out, start, SIZE_MAX, true);
+
+        if (!ok || br.overrun())
+            return false;
+    }
+}
+
+} // namespace z8
+
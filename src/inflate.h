@@ -0,0 +1,33 @@
+//
+//  ZEPTO-8 — Fantasy console emulator
+//
+//  Copyright © 2016—2020 Sam Hocevar <sam@hocevar.net>
+//
+//  This program is free software. It comes without any warranty, to
+//  the extent permitted by applicable law. You can redistribute it
+//  and/or modify it under the terms of the Do What the Fuck You Want
+//  to Public License, Version 2, as published by the WTFPL Task Force.
+//  See http://www.wtfpl.net/ for more details.
+//
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace z8
+{
+
+// Decompress a zlib stream (RFC 1950 header followed by RFC 1951 data)
+// and append the result to out. Returns false if the data is invalid or
+// if it would decompress to more than max_size bytes.
+bool inflate(uint8_t const *data, size_t size, std::vector<uint8_t> &out,
+             size_t max_size = SIZE_MAX);
+
+// Decompress a raw deflate stream in the GZ8 dialect of our zlib, the one
+// read by unz8.p8, and append the result to out
+bool inflate_gz8(uint8_t const *data, size_t size, std::vector<uint8_t> &out);
+
+} // namespace z8
+
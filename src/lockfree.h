@@ -0,0 +1,102 @@
+//
+//  ZEPTO-8 — Fantasy console emulator
+//
+//  Copyright © 2016—2020 Sam Hocevar <sam@hocevar.net>
+//
+//  This program is free software. It comes without any warranty, to
+//  the extent permitted by applicable law. You can redistribute it
+//  and/or modify it under the terms of the Do What the Fuck You Want
+//  to Public License, Version 2, as published by the WTFPL Task Force.
+//  See http://www.wtfpl.net/ for more details.
+//
+
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+
+// Lock-free helpers
+// —————————————————
+// Small wait-free containers for passing data between exactly one producer
+// thread and one consumer thread, e.g. the VM and the renderer, or the VM
+// and the audio callback. Neither side ever blocks or allocates.
+
+namespace z8
+{
+
+//
+// A triple buffer: the producer fills back() then calls publish(); the
+// consumer calls fetch() and, if it returns true, reads front(). The
+// consumer always sees the most recently published item and the producer
+// never waits for the consumer.
+//
+
+template<typename T>
+class triple_buffer
+{
+public:
+    T &back() { return m_items[m_back]; }
+
+    T const &front() const { return m_items[m_front]; }
+
+    void publish()
+    {
+        m_back = m_middle.exchange(m_back | fresh_bit,
+                                   std::memory_order_acq_rel) & index_mask;
+    }
+
+    bool fetch()
+    {
+        if (!(m_middle.load(std::memory_order_relaxed) & fresh_bit))
+            return false;
+        m_front = m_middle.exchange(m_front, std::memory_order_acq_rel) & index_mask;
+        return true;
+    }
+
+private:
+    static int const fresh_bit = 0x4;
+    static int const index_mask = 0x3;
+
+    T m_items[3];
+    int m_back = 0, m_front = 1;
+    std::atomic<int> m_middle { 2 };
+};
+
+//
+// A bounded single-producer, single-consumer FIFO. push() fails when the
+// queue is full and pop() fails when it is empty.
+//
+
+template<typename T, size_t N>
+class spsc_queue
+{
+public:
+    bool push(T const &item)
+    {
+        size_t head = m_head.load(std::memory_order_relaxed);
+        size_t next = (head + 1) % N;
+        if (next == m_tail.load(std::memory_order_acquire))
+            return false;
+        m_items[head] = item;
+        m_head.store(next, std::memory_order_release);
+        return true;
+    }
+
+    bool pop(T &item)
+    {
+        size_t tail = m_tail.load(std::memory_order_relaxed);
+        if (tail == m_head.load(std::memory_order_acquire))
+            return false;
+        item = m_items[tail];
+        m_tail.store((tail + 1) % N, std::memory_order_release);
+        return true;
+    }
+
+private:
+    T m_items[N];
+    // Keep the indices on separate cache lines to avoid false sharing
+    alignas(64) std::atomic<size_t> m_head { 0 };
+    alignas(64) std::atomic<size_t> m_tail { 0 };
+};
+
+} // namespace z8
@@ -1,7 +1,7 @@
 //
 //  ZEPTO-8 — Fantasy console emulator
 //
-//  Copyright © 2016—2018 Sam Hocevar <sam@hocevar.net>
+//  Copyright © 2016—2020 Sam Hocevar <sam@hocevar.net>
 //
 //  This program is free software. It comes without any warranty, to
 //  the extent permitted by applicable law. You can redistribute it
@@ -14,83 +14,751 @@
 #   include "config.h"
 #endif
 
+#include <lol/engine.h>
+
+#include <algorithm>
+#include <cctype>
+#include <numeric>
+#include <string>
+#include <string_view>
+#include <unordered_map>
 #include <vector>
-#include <iostream>
-#include <streambuf>
-#include <cstdint>
-#include <cstdlib>
-#include <regex>
 
+#include "analyzer.h"
 #include "minify.h"
+#include "pico8/pico8.h"
+
+// The minifier
+// ————————————
+// The code is tokenised once. Comments and whitespace are dropped, local
+// variables get short names, and tokens are glued back together with a
+// space only where they would otherwise merge. Lines that use PICO-8
+// one-line syntax (short if and while, compound assignments, “?” print)
+// keep their line breaks since PICO-8 parses them line by line.
+//
+// Special comments are still honoured: a line with a “-- debug” comment
+// is removed, and “replaces: a b c d” renames a to b and c to d.
 
 namespace z8
 {
 
+using type = token::type;
+
+// Whether an expression ending before t carries on with t
+static bool continues_expression(token const &t)
+{
+    switch (t.kind)
+    {
+    case type::string:
+        return true; // function call with a string argument
+    case type::keyword:
+        return t.text == "and" || t.text == "or";
+    case type::op:
+        if (t.text.size() > 1 && t.text.back() == '=')
+            return t.text == "==" || t.text == "~=" || t.text == "!="
+                || t.text == "<=" || t.text == ">=";
+        return t.text != ";" && t.text != "=" && t.text != "::" && t.text != "?"
+            && t.text != "#" && t.text != "@" && t.text != "$"
+            && t.text != ")" && t.text != "]" && t.text != "}";
+    default:
+        return false;
+    }
+}
+
+static bool is_compound_assignment(token const &t)
+{
+    return t.kind == type::op && t.text.size() > 1 && t.text.back() == '='
+        && !continues_expression(t);
+}
+
+static bool is_lua_keyword(std::string_view s)
+{
+    static char const *const keywords[] =
+    {
+        "and", "break", "do", "else", "elseif", "end", "false", "for",
+        "function", "goto", "if", "in", "local", "nil", "not", "or",
+        "repeat", "return", "then", "true", "until", "while",
+    };
+
+    for (std::string_view k : keywords)
+        if (s == k)
+            return true;
+    return false;
+}
+
+// Whether a space is needed between two tokens for them to be read back
+// as the same two tokens
+static bool needs_space(token const &a, std::string_view ta, std::string_view tb)
+{
+    auto is_word = [](uint8_t ch) { return isalnum(ch) || ch == '_' || ch >= 0x80; };
+    uint8_t last = uint8_t(ta.back()), first = uint8_t(tb.front());
+
+    // Names, keywords and numbers would merge, and numbers would also
+    // swallow a following dot.
+    if (is_word(last) && is_word(first))
+        return true;
+    if (a.kind == type::number && first == '.')
+        return true;
+
+    if (a.kind == type::op)
+    {
+        // “--” and “//” start comments, “[[” and “[=” start long strings,
+        // and a dot followed by a digit starts a number.
+        if ((last == '-' && first == '-') || (last == '/' && first == '/')
+             || (last == '[' && (first == '[' || first == '='))
+             || (ta == "." && isdigit(first)))
+            return true;
+
+        // Operators must not merge into a longer one, e.g. “..” and “.5”
+        if (!is_word(first) && first != '"' && first != '\'')
+        {
+            std::string s(ta);
+            s += tb.substr(0, 3);
+            return analyzer::match_operator(s) > ta.size();
+        }
+    }
+
+    return false;
+}
+
+// The .p8 format has the code in its __lua__ section; any other input
+// is considered to be Lua code.
+static std::string_view lua_section(std::string_view input)
+{
+    if (input.substr(0, 16) != "pico-8 cartridge")
+        return input;
+
+    size_t start = input.find("\n__lua__");
+    if (start == std::string_view::npos)
+        return std::string_view();
+    start = input.find('\n', start + 1);
+    if (start == std::string_view::npos)
+        return std::string_view();
+    ++start;
+
+    // The section ends with the next “__xxx__” line
+    for (size_t pos = start; pos < input.size(); )
+    {
+        size_t eol = std::min(input.find('\n', pos), input.size());
+        auto line = input.substr(pos, eol - pos);
+        if (!line.empty() && line.back() == '\r')
+            line.remove_suffix(1);
+        if (line.size() > 4 && line.substr(0, 2) == "__"
+             && line.substr(line.size() - 2) == "__"
+             && std::all_of(line.begin() + 2, line.end() - 2,
+                            [](char ch) { return isalnum(uint8_t(ch)); }))
+            return input.substr(start, pos - start);
+        pos = eol + 1;
+    }
+
+    return input.substr(start);
+}
+
+// Characters as PICO-8 sees them, for code in UTF-8
+static int count_chars(std::string_view s)
+{
+    return analyzer::count_chars(pico8::charset::utf8_to_pico8(std::string(s)));
+}
+
+// For “if (…)” and “while (…)” at index i, index of the token following
+// the closing bracket if it is on the same line and does not carry on the
+// condition, or -1.
+static int one_line_body(std::vector<token> const &tokens, int i)
+{
+    int const count = int(tokens.size());
+    if (i + 1 >= count || !tokens[i + 1].is(type::op, "("))
+        return -1;
+
+    int j = i + 1;
+    for (int nesting = 0; j < count; ++j)
+    {
+        if (tokens[j].is(type::op, "("))
+            ++nesting;
+        else if (tokens[j].is(type::op, ")") && --nesting == 0)
+            break;
+    }
+
+    if (j + 1 >= count || tokens[j + 1].line != tokens[j].line
+         || continues_expression(tokens[j + 1]))
+        return -1;
+    return j + 1;
+}
+
+// Whether the “if” or “while” at index i is a short form, whose body
+// ends with the line: the condition is followed by neither “then” nor “do”
+static bool is_short_form(std::vector<token> const &tokens, int i)
+{
+    int next = one_line_body(tokens, i);
+    return next >= 0 && !tokens[next].is(type::keyword, "then")
+                     && !tokens[next].is(type::keyword, "do");
+}
+
+// Resolves every name token to a local variable, a global, or a field or
+// label that must be left alone, then gives the locals short names. The
+// Lua syntax is only followed as far as scoping rules need, using a stack
+// of blocks and a stack of variables in scope.
+class renamer
+{
+public:
+    renamer(std::vector<token> const &tokens)
+      : m_tokens(tokens),
+        m_var(tokens.size(), -1)
+    {}
+
+    void run()
+    {
+        int const count = int(m_tokens.size());
+
+        m_blocks.push_back(block{ block::chunk, 0, 0, 0, false, {} });
+        for (int i = 0; i < count; ++i)
+            step(i);
+        while (!m_blocks.empty())
+            pop_block(count);
+
+        assign_names();
+    }
+
+    // New text for token i
+    std::string_view text(int i) const
+    {
+        return m_var[i] < 0 ? m_tokens[i].text
+                            : std::string_view(m_vars[m_var[i]].new_name);
+    }
+
+private:
+    struct variable
+    {
+        std::string_view name;
+        std::string new_name;
+        bool fixed = false;      // cannot be renamed, e.g. implicit “self”
+        int start = 0, end = 0;  // token range where the variable is in scope
+        int uses = 1;            // declaration and references
+        std::vector<int> refs;   // references, in order
+    };
+
+    struct block
+    {
+        enum kind_type
+        {
+            chunk,
+            body,     // do…end, then…end, function bodies
+            header,   // for and while before “do”, with loop variables
+            repeat,   // repeat…until, closes after the until expression
+            one_line, // short if and while, closes at the end of the line
+        };
+
+        kind_type kind;
+        size_t mark; // scope size when the block was opened
+        int depth;   // bracket depth when the block was opened
+        int line;
+        bool closing = false;
+        std::vector<int> vars;
+    };
+
+    // “local x = …” variables only come into scope after the statement
+    struct pending
+    {
+        std::vector<int> vars;
+        size_t blocks;
+        int depth;
+        bool assigned;
+    };
+
+    enum class mode
+    {
+        none,
+        local_names,
+        local_function,
+        for_names,
+        function_name,
+        parameters,
+    };
+
+    void step(int i)
+    {
+        auto const &t = m_tokens[i];
+
+        end_statements(i);
+
+        while (m_blocks.back().kind == block::one_line && t.line > m_blocks.back().line)
+        {
+            // The line may end with “local x”
+            if (m_mode == mode::local_names)
+            {
+                m_pending.pop_back();
+                m_mode = mode::none;
+            }
+            pop_block(i);
+        }
+
+        switch (m_mode)
+        {
+        case mode::local_names:
+            // Names are separated by commas; any other name starts the
+            // next statement, as in “local x” followed by “y = 0”.
+            if (t.kind == type::name && m_expect_name)
+            {
+                m_expect_name = false;
+                return declare(i, m_pending.back().vars);
+            }
+            if (t.is(type::op, ","))
+            {
+                m_expect_name = true;
+                return;
+            }
+            m_mode = mode::none;
+            if (t.is(type::op, "="))
+            {
+                m_pending.back().assigned = true;
+                return;
+            }
+            // “local a += 1” reads the outer “a”, so it cannot be renamed
+            if (is_compound_assignment(t))
+                for (int id : m_pending.back().vars)
+                    m_vars[id].fixed = true, m_vars[id].new_name = m_vars[id].name;
+            activate(m_pending.back().vars, i);
+            m_pending.pop_back();
+            break;
+
+        case mode::local_function:
+            m_mode = mode::none;
+            if (t.kind == type::name)
+            {
+                std::vector<int> vars;
+                declare(i, vars);
+                activate(vars, i);
+                m_mode = mode::function_name;
+                return;
+            }
+            break;
+
+        case mode::for_names:
+            if (t.kind == type::name)
+                return declare(i, m_blocks.back().vars);
+            if (t.is(type::op, ","))
+                return;
+            m_mode = mode::none;
+            break;
+
+        case mode::function_name:
+            if (t.is(type::op, ":"))
+            {
+                m_method = true;
+                return;
+            }
+            if (t.is(type::op, "("))
+            {
+                m_brackets.push_back('(');
+                push_block(block::body, i);
+                if (m_method)
+                {
+                    m_vars.push_back(variable{ "self", "self", true, 0, 0, 1, {} });
+                    m_blocks.back().vars.push_back(int(m_vars.size() - 1));
+                }
+                m_mode = mode::parameters;
+                return;
+            }
+            break;
+
+        case mode::parameters:
+            if (t.kind == type::name)
+                return declare(i, m_blocks.back().vars);
+            if (t.is(type::op, ")"))
+            {
+                m_brackets.pop_back();
+                activate(m_blocks.back().vars, i);
+                m_blocks.back().depth = int(m_brackets.size());
+                m_mode = mode::none;
+            }
+            return;
+
+        case mode::none:
+            break;
+        }
+
+        if (t.kind == type::op && t.text.size() == 1)
+        {
+            char ch = t.text[0];
+            if (ch == '(' || ch == '[' || ch == '{')
+                m_brackets.push_back(ch);
+            else if ((ch == ')' || ch == ']' || ch == '}') && !m_brackets.empty())
+                m_brackets.pop_back();
+        }
+        else if (t.kind == type::keyword)
+        {
+            keyword(i);
+        }
+        else if (t.kind == type::name && !is_field(i))
+        {
+            resolve(i);
+        }
+    }
+
+    void keyword(int i)
+    {
+        auto const &t = m_tokens[i];
+        auto &b = m_blocks.back();
+
+        if (t.text == "local")
+        {
+            if (i + 1 < int(m_tokens.size()) && m_tokens[i + 1].is(type::keyword, "function"))
+            {
+                m_local_function = true;
+            }
+            else
+            {
+                m_pending.push_back(pending{ {}, m_blocks.size(), int(m_brackets.size()), false });
+                m_mode = mode::local_names;
+                m_expect_name = true;
+            }
+        }
+        else if (t.text == "function")
+        {
+            m_mode = m_local_function ? mode::local_function : mode::function_name;
+            m_local_function = m_method = false;
+        }
+        else if (t.text == "for")
+        {
+            push_block(block::header, i);
+            m_mode = mode::for_names;
+        }
+        else if (t.text == "if" || t.text == "while")
+        {
+            // Short forms have a statement right after the condition, and
+            // “if (…) do” behaves like “if … then”.
+            int next = one_line_body(m_tokens, i);
+            bool then = next >= 0 && m_tokens[next].is(type::keyword, "then");
+            bool dofirst = next >= 0 && m_tokens[next].is(type::keyword, "do");
+            push_block(next >= 0 && !then && !dofirst ? block::one_line
+                       : t.text == "while" || dofirst ? block::header
+                       : block::body, i);
+        }
+        else if (t.text == "do")
+        {
+            if (b.kind == block::header)
+            {
+                activate(b.vars, i);
+                b.kind = block::body;
+            }
+            else
+            {
+                push_block(block::body, i);
+            }
+        }
+        else if (t.text == "repeat")
+        {
+            push_block(block::repeat, i);
+        }
+        else if (t.text == "until")
+        {
+            b.closing = true;
+        }
+        else if (t.text == "else" || t.text == "elseif")
+        {
+            close_scope(b.mark, i);
+        }
+        else if (t.text == "end")
+        {
+            if (m_blocks.size() > 1)
+                pop_block(i);
+        }
+    }
+
+    // Names after “.” and “:”, labels, and table constructor keys
+    bool is_field(int i) const
+    {
+        if (i == 0)
+            return false;
+
+        auto const &prev = m_tokens[i - 1];
+        if (prev.is(type::op, ".") || prev.is(type::op, ":")
+             || prev.is(type::op, "::") || prev.is(type::keyword, "goto"))
+            return true;
+
+        return i + 1 < int(m_tokens.size()) && m_tokens[i + 1].is(type::op, "=")
+                && !m_brackets.empty() && m_brackets.back() == '{'
+                && (prev.is(type::op, "{") || prev.is(type::op, ",") || prev.is(type::op, ";"));
+    }
+
+    // Bring “local x = …” variables into scope once the statement ends,
+    // and close “repeat” blocks once the “until” expression ends.
+    void end_statements(int i)
+    {
+        bool ended = i > 0 && m_tokens[i - 1].ends_expression()
+                      && !continues_expression(m_tokens[i]);
+        if (!ended)
+            return;
+
+        for (;;)
+        {
+            if (!m_pending.empty() && m_pending.back().assigned
+                 && m_pending.back().blocks == m_blocks.size()
+                 && m_pending.back().depth == int(m_brackets.size()))
+            {
+                activate(m_pending.back().vars, i);
+                m_pending.pop_back();
+            }
+            else if (m_blocks.back().closing
+                      && m_blocks.back().depth == int(m_brackets.size()))
+            {
+                pop_block(i);
+            }
+            else
+            {
+                break;
+            }
+        }
+    }
+
+    void declare(int i, std::vector<int> &vars)
+    {
+        m_var[i] = int(m_vars.size());
+        vars.push_back(m_var[i]);
+        m_vars.push_back(variable{ m_tokens[i].text, {}, false, 0, 0, 1, {} });
+    }
+
+    void activate(std::vector<int> const &vars, int i)
+    {
+        for (int id : vars)
+        {
+            m_vars[id].start = i;
+            m_scope.push_back(id);
+        }
+    }
+
+    void resolve(int i)
+    {
+        for (size_t k = m_scope.size(); k--; )
+        {
+            auto &v = m_vars[m_scope[k]];
+            if (v.name == m_tokens[i].text)
+            {
+                m_var[i] = v.fixed ? -1 : m_scope[k];
+                v.refs.push_back(i);
+                ++v.uses;
+                return;
+            }
+        }
+
+        m_globals[m_tokens[i].text].push_back(i);
+    }
+
+    void push_block(block::kind_type kind, int i)
+    {
+        m_blocks.push_back(block{ kind, m_scope.size(), int(m_brackets.size()),
+                                  m_tokens[i].line, false, {} });
+    }
+
+    void close_scope(size_t mark, int i)
+    {
+        for (size_t k = mark; k < m_scope.size(); ++k)
+            m_vars[m_scope[k]].end = i;
+        m_scope.resize(std::min(mark, m_scope.size()));
+    }
+
+    void pop_block(int i)
+    {
+        close_scope(m_blocks.back().mark, i);
+        m_blocks.pop_back();
+
+        // Declarations that never completed inside that block
+        while (!m_pending.empty() && m_pending.back().blocks > m_blocks.size())
+            m_pending.pop_back();
+    }
+
+    // Greedy allocation: the most used variables pick first from the
+    // shortest names. Two variables may share a name unless the outer one
+    // is referenced while the inner one is in scope, and a variable may
+    // not take the name of a global referenced while it is in scope.
+    void assign_names()
+    {
+        auto used_within = [](std::vector<int> const &refs, int start, int end)
+        {
+            auto it = std::lower_bound(refs.begin(), refs.end(), start);
+            return it != refs.end() && *it < end;
+        };
+
+        std::unordered_map<std::string, std::vector<int>> taken;
+        for (int id = 0; id < int(m_vars.size()); ++id)
+            if (m_vars[id].fixed)
+                taken[m_vars[id].new_name].push_back(id);
+
+        std::vector<int> order(m_vars.size());
+        std::iota(order.begin(), order.end(), 0);
+        std::stable_sort(order.begin(), order.end(), [&](int a, int b)
+        {
+            return m_vars[a].uses > m_vars[b].uses;
+        });
+
+        for (int id : order)
+        {
+            auto &v = m_vars[id];
+            if (v.fixed)
+                continue;
+
+            for (size_t k = 0; ; ++k)
+            {
+                std::string const &name = short_name(k);
+
+                auto g = m_globals.find(name);
+                if (g != m_globals.end() && used_within(g->second, v.start, v.end))
+                    continue;
+
+                auto &list = taken[name];
+                if (std::any_of(list.begin(), list.end(), [&](int other)
+                {
+                    auto const &w = m_vars[other];
+                    return (w.start <= v.start && used_within(w.refs, v.start, v.end))
+                            || (v.start <= w.start && used_within(v.refs, w.start, w.end));
+                }))
+                    continue;
+
+                list.push_back(id);
+                v.new_name = name;
+                break;
+            }
+        }
+    }
+
+    // The k-th shortest valid name: a…z, _, then aa, ab, …
+    std::string const &short_name(size_t k)
+    {
+        static char const first[] = "abcdefghijklmnopqrstuvwxyz_";
+        static char const other[] = "abcdefghijklmnopqrstuvwxyz_0123456789";
+
+        while (k >= m_names.size())
+        {
+            size_t n = m_next_name++;
+            std::string name(1, first[n % 27]);
+            for (n /= 27; n > 0; n = (n - 1) / 37)
+                name += other[(n - 1) % 37];
+            if (!is_lua_keyword(name))
+                m_names.push_back(name);
+        }
+
+        return m_names[k];
+    }
+
+    std::vector<token> const &m_tokens;
+    std::vector<int> m_var; // variable index for each token, or -1
+    std::vector<variable> m_vars;
+    std::unordered_map<std::string_view, std::vector<int>> m_globals;
+
+    std::vector<block> m_blocks;
+    std::vector<int> m_scope;
+    std::vector<pending> m_pending;
+    std::vector<char> m_brackets;
+    mode m_mode = mode::none;
+    bool m_local_function = false, m_method = false;
+    bool m_expect_name = false;
+
+    std::vector<std::string> m_names;
+    size_t m_next_name = 0;
+};
+
 std::string minify(std::string const &input)
 {
-    std::regex re_spaces(" +");
-
-    // Split input into lines
-    std::vector<std::string> lines;
-    std::regex re_crlf("\r*\n");
-    std::copy(std::sregex_token_iterator(input.begin(), input.end(), re_crlf, -1),
-              std::sregex_token_iterator(),
-              std::back_inserter(lines));
-
-    // Skip first three lines (they’re the PICO-8 cart header)
-    lines.erase(lines.begin(), lines.begin() + 3);
-
-    std::vector<std::tuple<std::string, std::string>> replaces;
-    std::string result;
-
-    // Process each line
-    for (auto & line : lines)
-    {
-        // Parse special comments indicating possible replacements
-        static std::regex re_replaces("^(.*--.*replaces: |.*)");
-        static std::regex re_replace_pair(" *([^ ]+) *([^ ]+) *");
-        std::vector<std::string> replaces_list;
-        auto tmp = std::regex_replace(line, re_replaces, "");
-        std::copy(std::sregex_token_iterator(tmp.begin(), tmp.end(), re_spaces, -1),
-                  std::sregex_token_iterator(),
-                  std::back_inserter(replaces_list));
-        for (size_t i = 0; i + 1 < replaces_list.size(); i += 2)
-            replaces.push_back(std::make_tuple(replaces_list[i], replaces_list[i + 1]));
-
-        // Strip comments; if comment starts with "debug" then whole line is stripped
-        static std::regex re_comment("(^.*-- *debug| *--).*");
-        line = std::regex_replace(line, re_comment, "");
-
-        // Ignore empty lines
-        static std::regex re_empty("^ *$");
-        if (std::regex_match(line, re_empty))
+    auto code = lua_section(input);
+
+    std::vector<token> tokens;
+    if (!analyzer::tokenize(code, tokens))
+        return std::string(code);
+
+    // Parse special comments
+    std::vector<bool> debug_lines(tokens.empty() ? 0 : tokens.back().line + 1);
+    std::unordered_map<std::string_view, std::string_view> replaces;
+    for (auto const &t : tokens)
+    {
+        if (t.kind != type::comment)
             continue;
 
-        // Protect lines that contain +=, -= etc.
-        static std::regex re_compound(".*[-+*/%]=.*");
-        line = std::regex_replace(line, re_compound, "X $0 X");
+        auto s = t.text.substr(2);
+        if (s.substr(std::min(s.find_first_not_of(' '), s.size()), 5) == "debug")
+            debug_lines[t.line] = true;
+
+        size_t pos = s.find("replaces:");
+        if (pos == std::string_view::npos)
+            continue;
+
+        std::vector<std::string_view> words;
+        for (s.remove_prefix(pos + 9); !s.empty(); )
+        {
+            size_t start = s.find_first_not_of(" \t\r\n");
+            if (start == std::string_view::npos)
+                break;
+            size_t end = std::min(s.find_first_of(" \t\r\n", start), s.size());
+            words.push_back(s.substr(start, end - start));
+            s.remove_prefix(end);
+        }
+        for (size_t i = 0; i + 1 < words.size(); i += 2)
+            replaces[words[i]] = words[i + 1];
+    }
+
+    // Keep the tokens that matter
+    std::vector<token> kept;
+    for (auto t : tokens)
+    {
+        if (t.kind == type::comment || debug_lines[t.line])
+            continue;
 
-        result += result.empty() ? line : " " + line;
+        auto rep = t.kind == type::name ? replaces.find(t.text) : replaces.end();
+        if (rep != replaces.end())
+            t.text = rep->second;
+        kept.push_back(t);
     }
 
-    // Rename all variables according to our rules
-    for (auto & rep : replaces)
-        result = std::regex_replace(result, std::regex("([^a-z_])(" + std::get<0>(rep) + ")([^a-z0-9_])"), "$1" + std::get<1>(rep) + "$3");
+    renamer r(kept);
+    r.run();
 
-    // Strip multiple spaces
-    result = std::regex_replace(result, re_spaces, " ");
+    // Find lines that PICO-8 parses on their own: short if and while
+    // statements, compound assignments, “?” print and #include.
+    std::vector<bool> own_line(kept.empty() ? 0 : kept.back().line + 1);
+    for (size_t i = 0, start = 0; i < kept.size(); ++i)
+    {
+        auto const &t = kept[i];
+        if (i == 0 || t.line != kept[i - 1].line)
+            start = i;
 
-    // Exploit Lua parsing rules
-    result = std::regex_replace(result, std::regex("0 ([g-wyz])"), "0$1");
-    result = std::regex_replace(result, std::regex("([1-9]) ([g-z])"), "$1$2");
+        if (is_compound_assignment(t) || (i == start && (t.is(type::op, "?") || t.is(type::op, "#"))))
+            own_line[t.line] = true;
 
-    // Unprotect lines protected with X
-    result = std::regex_replace(result, std::regex(" *X[ X]*"), " ");
+        if ((t.is(type::keyword, "if") || t.is(type::keyword, "while"))
+             && is_short_form(kept, int(i)))
+            own_line[t.line] = true;
+    }
+
+    std::string ret;
+    ret.reserve(code.size());
+    for (size_t i = 0; i < kept.size(); ++i)
+    {
+        auto text = r.text(int(i));
+        if (i > 0)
+        {
+            auto const &prev = kept[i - 1];
+            if (prev.line != kept[i].line && (own_line[prev.line] || own_line[kept[i].line]))
+                ret += '\n';
+            else if (needs_space(prev, r.text(int(i - 1)), text))
+                ret += ' ';
+        }
+        ret += text;
+    }
+
+    // Make sure the output reads back as the same tokens
+    std::vector<token> check;
+    bool ok = analyzer::tokenize(ret, check) && check.size() == kept.size();
+    for (size_t i = 0; ok && i < check.size(); ++i)
+        ok = check[i].kind == kept[i].kind && check[i].text == r.text(int(i));
+    if (!ok)
+    {
+        lol::msg::error("minified code does not match the original tokens\n");
+        return std::string(code);
+    }
 
-    // Remove spaces before and after symbols
-    result = std::regex_replace(result, std::regex(" *([[\\]<>(){}#+*%^/=:!~,-]) *"), "$1");
+    lol::msg::info("minify: %d tokens, %d chars -> %d tokens, %d chars\n",
+                   analyzer::count_tokens(tokens), count_chars(code),
+                   analyzer::count_tokens(check), count_chars(ret));
 
-    return result;
+    return ret;
 }
 
 } // namespace z8
@@ -16,13 +16,21 @@
 
 #include <lol/engine.h>
 
-#include "tao/pegtl.hpp"
-
 #include "zepto8.h"
+#include "inflate.h"
 #include "pico8/cart.h"
 #include "pico8/pico8.h"
+#include "pico8/pxa.h"
 
+#include <array>
+#include <mutex>
 #include <regex>
+#if HAVE_SYS_MMAN_H
+#   include <fcntl.h>
+#   include <sys/mman.h>
+#   include <sys/stat.h>
+#   include <unistd.h>
+#endif
 
 namespace z8::pico8
 {
@@ -32,12 +40,76 @@ using lol::msg;
 using lol::u8vec4;
 using lol::PixelFormat;
 
-using namespace tao;
+static std::string read_file(std::string const &filename)
+{
+    std::string s;
+    lol::File f;
+    for (auto const &candidate : lol::sys::get_path_list(filename))
+    {
+        f.Open(candidate, lol::FileAccess::Read);
+        if (f.IsValid())
+        {
+            s = f.ReadString();
+            f.Close();
+
+            msg::debug("loaded file %s\n", candidate.c_str());
+            break;
+        }
+    }
+    return s;
+}
+
+// 64-bit FNV-1a, used to identify cart sources in binary caches
+static uint64_t hash_source(std::string const &s)
+{
+    uint64_t ret = 0xcbf29ce484222325ull;
+    for (uint8_t ch : s)
+        ret = (ret ^ ch) * 0x100000001b3ull;
+    return ret;
+}
+
+// Where load() looks for caches of the carts it parses
+static std::string cache_dir;
+
+void cart::set_cache_dir(std::string const &dir)
+{
+    cache_dir = dir;
+}
+
+std::string cart::get_cache_name() const
+{
+    auto name = lol::format("%016llx.z8c", (unsigned long long)m_hash);
+    return cache_dir.empty() ? name : cache_dir + "/" + name;
+}
 
 bool cart::load(std::string const &filename)
 {
-    if (load_p8(filename) || load_png(filename))
+    // Binary caches need no parsing at all
+    if (lol::ends_with(filename, ".z8c"))
+        return load_cache(filename);
+
+    // Caches may also have been saved under another name
+    std::string data = read_file(filename);
+    if (load_cache((uint8_t const *)data.data(), data.size()))
+        return true;
+
+    // Use the cache of this exact source, if there is one
+    uint64_t const hash = hash_source(data);
+    if (!cache_dir.empty())
+    {
+        cart cached;
+        cached.m_hash = hash;
+        if (cached.load_cache(cached.get_cache_name()) && cached.m_hash == hash)
+        {
+            *this = std::move(cached);
+            return true;
+        }
+    }
+
+    if (load_p8(data) || load_png(filename, data))
     {
+        m_hash = hash;
+
         // Dump code to stdout
         //msg::info("Cartridge code:\n");
         //printf("%s", m_code.c_str());
@@ -48,12 +120,180 @@ bool cart::load(std::string const &filename)
     return false;
 }
 
-static uint8_t const *compress_lut = nullptr;
 static char const *decompress_lut = "\n 0123456789abcdefghijklmnopqrstuvwxyz!#%(){}[]<>+=/*:;.,~_";
 
-bool cart::load_png(std::string const &filename)
+//
+// A direct .p8.png decoder: the PNG scanlines are inflated and unfiltered
+// in place, then the cart bytes and the label are read straight from them
+// without going through an intermediate image.
+//
+
+static uint32_t png_u32(uint8_t const *p)
+{
+    return (uint32_t(p[0]) << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+static uint8_t png_paeth(int a, int b, int c)
+{
+    int p = a + b - c;
+    int pa = std::abs(p - a), pb = std::abs(p - b), pc = std::abs(p - c);
+    return uint8_t(pa <= pb && pa <= pc ? a : pb <= pc ? b : c);
+}
+
+// Undo the PNG row filters of an 8-bit RGBA image, in place
+static bool png_unfilter(uint8_t *data, int width, int height)
+{
+    int const bpp = 4, len = width * bpp;
+    static uint8_t const zero[4 * 256] = { 0 };
+
+    for (int y = 0; y < height; ++y)
+    {
+        uint8_t *row = data + y * (len + 1) + 1;
+        uint8_t const *prev = y ? row - len - 1 : zero;
+
+        switch (row[-1])
+        {
+        case 0:
+            break;
+        case 1:
+            for (int x = bpp; x < len; ++x)
+                row[x] += row[x - bpp];
+            break;
+        case 2:
+            for (int x = 0; x < len; ++x)
+                row[x] += prev[x];
+            break;
+        case 3:
+            for (int x = 0; x < bpp; ++x)
+                row[x] += prev[x] / 2;
+            for (int x = bpp; x < len; ++x)
+                row[x] += (row[x - bpp] + prev[x]) / 2;
+            break;
+        case 4:
+            for (int x = 0; x < bpp; ++x)
+                row[x] += prev[x];
+            for (int x = bpp; x < len; ++x)
+                row[x] += png_paeth(row[x - bpp], prev[x], prev[x - bpp]);
+            break;
+        default:
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// Map a label pixel to a palette index, using a lookup table on the top
+// 3 bits of each channel. This is the smallest key that separates all 16
+// palette colours (light gray and white share their top 2 bits). Bins that
+// straddle two palette colours are flagged and go through the slow search.
+static uint8_t label_color(uint8_t const *p)
+{
+    static auto const lut = []()
+    {
+        std::array<uint8_t, 512> ret;
+        for (int i = 0; i < 512; ++i)
+        {
+            // Nearest-colour regions are convex, so the bin maps to a single
+            // colour if all its corners do.
+            int r = (i >> 6) * 32, g = (i >> 3 & 7) * 32, b = (i & 7) * 32;
+            ret[i] = palette::best(u8vec4(r, g, b, 255));
+            for (int k = 1; k < 8; ++k)
+            {
+                u8vec4 corner(r + (k & 1) * 31, g + (k >> 1 & 1) * 31,
+                              b + (k >> 2) * 31, 255);
+                if (palette::best(corner) != ret[i])
+                    ret[i] = 0xff;
+            }
+        }
+        return ret;
+    }();
+
+    uint8_t ret = lut[(p[0] >> 5) << 6 | (p[1] >> 5) << 3 | (p[2] >> 5)];
+    return ret != 0xff ? ret : palette::best(u8vec4(p[0], p[1], p[2], 255));
+}
+
+static bool decode_png(std::string const &s, std::vector<uint8_t> &bytes,
+                       std::vector<uint8_t> &label)
+{
+    static uint8_t const signature[] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n' };
+    uint8_t const *p = (uint8_t const *)s.data(), *end = p + s.size();
+    if (s.size() < 8 || memcmp(p, signature, 8) != 0)
+        return false;
+
+    // Walk the chunk list, checking the header and gathering image data
+    int width = 0, height = 0;
+    std::vector<uint8_t> idat;
+    for (p += 8; end - p >= 12; )
+    {
+        uint32_t len = png_u32(p);
+        uint8_t const *data = p + 8;
+        if (len > uint32_t(end - data) - 4)
+            return false;
+
+        if (!memcmp(p + 4, "IHDR", 4))
+        {
+            // Only 8-bit RGBA, non-interlaced images are handled here
+            if (len < 13 || data[8] != 8 || data[9] != 6 || data[12] != 0)
+                return false;
+            width = int(png_u32(data));
+            height = int(png_u32(data + 4));
+        }
+        else if (!memcmp(p + 4, "IDAT", 4))
+            idat.insert(idat.end(), data, data + len);
+        else if (!memcmp(p + 4, "IEND", 4))
+            break;
+
+        p = data + len + 4;
+    }
+
+    if (width != 160 || height != 205)
+        return false;
+
+    // Each scanline is a filter byte followed by the RGBA pixels, and any
+    // data past the last one is an error rather than something to inflate
+    size_t const expected = size_t(width * 4 + 1) * height;
+    std::vector<uint8_t> pixels;
+    pixels.reserve(expected);
+    if (!z8::inflate(idat.data(), idat.size(), pixels, expected)
+         || pixels.size() < expected
+         || !png_unfilter(pixels.data(), width, height))
+        return false;
+
+    auto pixel = [&](int x, int y) { return &pixels[y * (width * 4 + 1) + 1 + x * 4]; };
+
+    // Retrieve cartridge data from lower image bits
+    for (int n = 0; n < (int)bytes.size(); ++n)
+    {
+        uint8_t const *q = pixel(n % width, n / width);
+        bytes[n] = (q[3] & 3) << 6 | (q[0] & 3) << 4 | (q[1] & 3) << 2 | (q[2] & 3);
+    }
+
+    // Retrieve label from image pixels
+    label.resize(LABEL_WIDTH * LABEL_HEIGHT / 2);
+    for (int y = 0; y < LABEL_HEIGHT; ++y)
+    for (int x = 0; x < LABEL_WIDTH; x += 2)
+    {
+        uint8_t lo = label_color(pixel(x + LABEL_X, y + LABEL_Y));
+        uint8_t hi = label_color(pixel(x + 1 + LABEL_X, y + LABEL_Y));
+        label[(y * LABEL_WIDTH + x) / 2] = lo | hi << 4;
+    }
+
+    return true;
+}
+
+// Carts are loaded and converted from several threads in batch mode, but
+// lol::image and its codecs make no thread-safety promise, so every use
+// of them in this file holds this lock.
+static std::mutex image_mutex;
+
+// Slow path for PNG files that are not 8-bit RGBA, e.g. after an image
+// editor resaved them with a different pixel format
+static bool decode_png_image(std::string const &filename, std::vector<uint8_t> &bytes,
+                             std::vector<uint8_t> &label)
 {
-    // Open cartridge as PNG image
+    std::lock_guard<std::mutex> lock(image_mutex);
+
     lol::image img;
     img.load(filename);
     ivec2 size = img.size();
@@ -64,39 +304,64 @@ bool cart::load_png(std::string const &filename)
     u8vec4 const *pixels = img.lock<PixelFormat::RGBA_8>();
 
     // Retrieve cartridge data from lower image bits
-    std::vector<uint8_t> bytes(sizeof(m_rom) + 5);
     for (int n = 0; n < (int)bytes.size(); ++n)
     {
         u8vec4 p = pixels[n] * 64;
         bytes[n] = p.a + p.r / 4 + p.g / 16 + p.b / 64;
     }
 
-    memcpy(&m_rom, bytes.data(), sizeof(m_rom));
-    uint8_t const *vbytes = bytes.data() + sizeof(m_rom);
-    int version = vbytes[0];
-    int minor = (vbytes[1] << 24) | (vbytes[2] << 16) | (vbytes[3] << 8) | vbytes[4];
-
     // Retrieve label from image pixels
     if (size.x >= LABEL_WIDTH + LABEL_X && size.y >= LABEL_HEIGHT + LABEL_Y)
     {
-        m_label.resize(LABEL_WIDTH * LABEL_HEIGHT / 2);
+        label.resize(LABEL_WIDTH * LABEL_HEIGHT / 2);
         for (int y = 0; y < LABEL_HEIGHT; ++y)
         for (int x = 0; x < LABEL_WIDTH; ++x)
         {
             lol::u8vec4 p = pixels[(y + LABEL_Y) * size.x + (x + LABEL_X)];
             uint8_t c = palette::best(p);
             if (x & 1)
-                m_label[(y * LABEL_WIDTH + x) / 2] += c << 4;
+                label[(y * LABEL_WIDTH + x) / 2] += c << 4;
             else
-                m_label[(y * LABEL_WIDTH + x) / 2] = c;
+                label[(y * LABEL_WIDTH + x) / 2] = c;
         }
     }
 
     img.unlock(pixels);
+    return true;
+}
+
+bool cart::load_png(std::string const &filename, std::string const &data)
+{
+    std::vector<uint8_t> bytes(sizeof(m_rom) + 5);
+    if (!decode_png(data, bytes, m_label)
+         && !decode_png_image(filename, bytes, m_label))
+        return false;
+
+    return load_bin(bytes);
+}
+
+bool cart::load_bin(std::vector<uint8_t> const &bin)
+{
+    // The ROM, then the version byte and the optional 32-bit minor version
+    if (bin.size() < sizeof(m_rom) + 1)
+        return false;
+
+    std::vector<uint8_t> bytes(bin);
+    bytes.resize(std::max(bytes.size(), sizeof(m_rom) + 5));
+
+    memcpy(&m_rom, bytes.data(), sizeof(m_rom));
+    uint8_t const *vbytes = bytes.data() + sizeof(m_rom);
+    int version = vbytes[0];
+    int minor = (vbytes[1] << 24) | (vbytes[2] << 16) | (vbytes[3] << 8) | vbytes[4];
 
     // Retrieve code, with optional decompression
-    if (version == 0 || m_rom.code[0] != ':' || m_rom.code[1] != 'c'
-                     || m_rom.code[2] != ':' || m_rom.code[3] != '\0')
+    if (pxa::is_pxa(m_rom.code, sizeof(m_rom.code)))
+    {
+        if (!pxa::decompress(m_rom.code, sizeof(m_rom.code), m_code))
+            msg::warn("invalid PXA code data, got %d bytes\n", (int)m_code.length());
+    }
+    else if (version == 0 || m_rom.code[0] != ':' || m_rom.code[1] != 'c'
+                          || m_rom.code[2] != ':' || m_rom.code[3] != '\0')
     {
         int length = 0;
         while (length < (int)sizeof(m_rom.code) && m_rom.code[length] != '\0')
@@ -146,62 +411,11 @@ bool cart::load_png(std::string const &filename)
 }
 
 //
-// A speacial parser object for the .p8 format
+// A streaming reader for the .p8 format
 //
 
 struct p8_reader
 {
-    //
-    // Grammar rules
-    //
-
-    struct r_lua : TAO_PEGTL_STRING("__lua__") {};
-    struct r_gfx : TAO_PEGTL_STRING("__gfx__") {};
-    struct r_gff : TAO_PEGTL_STRING("__gff__") {};
-    struct r_map : TAO_PEGTL_STRING("__map__") {};
-    struct r_sfx : TAO_PEGTL_STRING("__sfx__") {};
-    struct r_mus : TAO_PEGTL_STRING("__music__") {};
-    struct r_lab : TAO_PEGTL_STRING("__label__") {};
-    struct r_any : pegtl::seq<pegtl::two<'_'>, pegtl::plus<pegtl::alnum>, pegtl::two<'_'>> {};
-
-    struct r_section_name : pegtl::sor<r_lua,
-                                       r_gfx,
-                                       r_gff,
-                                       r_map,
-                                       r_sfx,
-                                       r_mus,
-                                       r_lab,
-                                       r_any> {};
-    struct r_section_line : pegtl::seq<r_section_name, pegtl::eolf> {};
-
-    struct r_data_line : pegtl::until<pegtl::eolf> {};
-    struct r_data : pegtl::star<pegtl::not_at<r_section_line>,
-                                pegtl::not_at<pegtl::eof>,
-                                r_data_line> {};
-
-    struct r_section : pegtl::seq<r_section_line, r_data> {};
-    struct r_version : pegtl::star<pegtl::digit> {};
-
-    struct r_header: pegtl::seq<TAO_PEGTL_STRING("pico-8 cartridge"), pegtl::until<pegtl::eol>,
-                                TAO_PEGTL_STRING("version "), r_version, pegtl::until<pegtl::eol>> {};
-    struct r_file : pegtl::seq<pegtl::opt<pegtl::utf8::bom>,
-                               r_header,
-                               r_data, /* data before the first section is ignored */
-                               pegtl::star<r_section>,
-                               pegtl::eof> {};
-
-    //
-    // Grammar actions
-    //
-
-    template<typename R> struct action {};
-
-    //
-    // Parser state
-    //
-
-    int m_version = -1;
-
     enum class section : int8_t
     {
         error = -1,
@@ -215,93 +429,253 @@ struct p8_reader
         lab,
     };
 
-    section m_current_section;
-    std::map<int8_t, std::vector<uint8_t>> m_sections;
+    p8_reader(memory &rom, std::vector<uint8_t> &label)
+      : m_rom(rom),
+        m_label(label)
+    {}
+
+    // Parse a whole file; returns false if the header is invalid
+    bool parse(char const *p, char const *end);
+
+    int m_version = -1;
     std::string m_code;
 
-    //
-    // Actual reader
-    //
+    // Number of bytes found in each section, for diagnostics
+    size_t m_count[8] = { 0 };
 
-    void parse(std::string const &str)
-    {
-        pegtl::string_input<> in(str, "p8");
-        pegtl::parse<r_file, action>(in, *this);
-    }
+private:
+    static section get_section(char const *p, char const *end);
+    void decode(section s, char const *p, char const *end);
+    void write(section s, uint8_t const *data, size_t size);
 
+    memory &m_rom;
+    std::vector<uint8_t> &m_label;
+
+    // Partial SFX and song records, when they span several lines
+    uint8_t m_record[4 + 80];
 };
 
-template<>
-struct p8_reader::action<p8_reader::r_version>
+// Hexadecimal digit values, or -1 for other characters
+static int8_t const *hex_lut()
+{
+    static int8_t const *lut = []()
+    {
+        static int8_t ret[256];
+        for (int i = 0; i < 256; ++i)
+            ret[i] = i >= '0' && i <= '9' ? i - '0'
+                   : i >= 'a' && i <= 'f' ? i - 'a' + 10
+                   : i >= 'A' && i <= 'F' ? i - 'A' + 10 : -1;
+        return ret;
+    }();
+    return lut;
+}
+
+bool p8_reader::parse(char const *p, char const *end)
 {
-    template<typename Input>
-    static void apply(Input const &in, p8_reader &r)
+    // Optional UTF-8 BOM, then “pico-8 cartridge…” and “version <n>” lines
+    if (end - p >= 3 && !memcmp(p, "\xef\xbb\xbf", 3))
+        p += 3;
+
+    auto next_line = [&end](char const *q)
+    {
+        q = (char const *)memchr(q, '\n', end - q);
+        return q ? q + 1 : end;
+    };
+
+    static char const *magic = "pico-8 cartridge";
+    if (end - p < 16 || memcmp(p, magic, 16))
+        return false;
+    p = next_line(p);
+
+    if (end - p < 8 || memcmp(p, "version ", 8))
+        return false;
+    m_version = 0;
+    for (p += 8; p < end && *p >= '0' && *p <= '9'; ++p)
+        m_version = m_version * 10 + *p - '0';
+    p = next_line(p);
+
+    // Data before the first section is ignored
+    section current = section::header;
+    char const *code_start = nullptr;
+
+    for (char const *line = p; line < end; )
     {
-        r.m_version = std::atoi(in.string().c_str());
+        char const *eol = next_line(line);
+
+        section s = get_section(line, eol);
+        if (s != section::header)
+        {
+            if (code_start)
+                m_code.append(code_start, line);
+            code_start = s == section::lua ? eol : nullptr;
+            current = s;
+        }
+        else if (current != section::lua && current != section::header
+                  && current != section::error)
+        {
+            decode(current, line, eol);
+        }
+
+        line = eol;
     }
-};
 
-template<>
-struct p8_reader::action<p8_reader::r_section_name>
-{
-    template<typename Input>
-    static void apply(Input const &in, p8_reader &r)
-    {
-        if (in.string().find("lua") != std::string::npos)
-            r.m_current_section = section::lua;
-        else if (in.string().find("gfx") != std::string::npos)
-            r.m_current_section = section::gfx;
-        else if (in.string().find("gff") != std::string::npos)
-            r.m_current_section = section::gff;
-        else if (in.string().find("map") != std::string::npos)
-            r.m_current_section = section::map;
-        else if (in.string().find("sfx") != std::string::npos)
-            r.m_current_section = section::sfx;
-        else if (in.string().find("music") != std::string::npos)
-            r.m_current_section = section::mus;
-        else if (in.string().find("label") != std::string::npos)
-            r.m_current_section = section::lab;
-        else
+    if (code_start)
+        m_code.append(code_start, end);
+
+    return true;
+}
+
+// Return the section started by this line, or section::header if the
+// line is not a section header
+p8_reader::section p8_reader::get_section(char const *p, char const *end)
+{
+    // Section lines are “__name__” followed by an end of line
+    if (end > p && end[-1] == '\n')
+        --end;
+    if (end > p && end[-1] == '\r')
+        --end;
+
+    if (end - p < 5 || p[0] != '_' || p[1] != '_' || end[-1] != '_' || end[-2] != '_')
+        return section::header;
+
+    std::string name(p + 2, end - 2);
+    for (char ch : name)
+        if (!isalnum((uint8_t)ch))
+            return section::header;
+
+    if (name == "lua") return section::lua;
+    if (name == "gfx") return section::gfx;
+    if (name == "gff") return section::gff;
+    if (name == "map") return section::map;
+    if (name == "sfx") return section::sfx;
+    if (name == "music") return section::mus;
+    if (name == "label") return section::lab;
+
+    msg::info("unknown section name %s\n", name.c_str());
+    return section::error;
+}
+
+// Decode hexadecimal digit pairs from a line, skipping other characters,
+// and send them to the section in chunks
+void p8_reader::decode(section s, char const *p, char const *end)
+{
+    int8_t const *lut = hex_lut();
+    bool const must_swap = s == section::gfx || s == section::lab;
+    int const hi = must_swap ? 0 : 4, lo = must_swap ? 4 : 0;
+
+    uint8_t buf[128];
+    size_t count = 0;
+
+    for (; p < end; ++p)
+    {
+        int8_t a = lut[(uint8_t)p[0]];
+        if (a < 0)
+            continue;
+
+        int8_t b = p + 1 < end ? lut[(uint8_t)p[1]] : 0;
+        buf[count++] = uint8_t((a << hi) | (lol::max(b, int8_t(0)) << lo));
+        ++p;
+
+        if (count == sizeof(buf))
         {
-            msg::info("unknown section name %s\n", in.string().c_str());
-            r.m_current_section = section::error;
+            write(s, buf, count);
+            count = 0;
         }
     }
-};
 
-template<>
-struct p8_reader::action<p8_reader::r_data>
+    if (count)
+        write(s, buf, count);
+}
+
+// Store decoded bytes directly into the ROM
+void p8_reader::write(section s, uint8_t const *data, size_t size)
 {
-    template<typename Input>
-    static void apply(Input const &in, p8_reader &r)
+    size_t &offset = m_count[(int)s];
+
+    auto copy = [&](void *dst, size_t dst_size)
     {
-        if (r.m_current_section == section::lua)
+        if (offset < dst_size)
+            memcpy((uint8_t *)dst + offset, data, std::min(size, dst_size - offset));
+    };
+
+    switch (s)
+    {
+    case section::gfx:
+        // The optional second chunk of gfx is contiguous
+        copy(&m_rom.gfx, sizeof(m_rom.gfx));
+        break;
+    case section::gff:
+        copy(&m_rom.gfx_props, sizeof(m_rom.gfx_props));
+        break;
+    case section::map:
+        copy(&m_rom.map, sizeof(m_rom.map));
+        // Use binary OR for the optional second chunk because some old
+        // versions of PICO-8 would store a full gfx+gfx2 section AND a
+        // full map+map2 section, so we cannot really decide which one
+        // is relevant.
+        for (size_t i = 0; i < size; ++i)
         {
-            // Copy the code verbatim
-            r.m_code += in.string();
+            size_t n = offset + i - sizeof(m_rom.map);
+            if (offset + i >= sizeof(m_rom.map) && n < sizeof(m_rom.map2))
+                m_rom.map2[n] |= data[i];
         }
-        else
+        break;
+    case section::lab:
+        m_label.resize(std::min(offset + size, size_t(LABEL_WIDTH * LABEL_HEIGHT / 2)));
+        copy(m_label.data(), m_label.size());
+        break;
+    case section::sfx:
+    case section::mus:
+    {
+        // Records are re-encoded once complete
+        size_t const record_size = s == section::sfx ? 4 + 80 : 5;
+        for (size_t i = 0; i < size; ++i)
         {
-            bool must_swap = r.m_current_section == section::gfx
-                          || r.m_current_section == section::lab;
+            size_t n = (offset + i) / record_size;
+            size_t k = (offset + i) % record_size;
+            m_record[k] = data[i];
+            if (k + 1 < record_size)
+                continue;
 
-            // Decode hexadecimal data from this section
-            auto &section = r.m_sections[(int8_t)r.m_current_section];
-            for (uint8_t const *parser = (uint8_t const *)in.begin(); parser < (uint8_t const *)in.end(); ++parser)
+            if (s == section::mus && n < sizeof(m_rom.song) / 4)
             {
-                if ((parser[0] >= 'a' && parser[0] <= 'f')
-                     || (parser[0] >= 'A' && parser[0] <= 'F')
-                     || (parser[0] >= '0' && parser[0] <= '9'))
+                for (int ch = 0; ch < 4; ++ch)
+                    m_rom.song[n].data[ch] = m_record[ch + 1]
+                                           | ((m_record[0] << (7 - ch)) & 0x80);
+            }
+            else if (s == section::sfx && n < sizeof(m_rom.sfx) / (4 + 32 * 2))
+            {
+                auto &sfx = m_rom.sfx[n];
+                for (int j = 0; j < 32; ++j)
                 {
-                    char str[3] = { (char)parser[must_swap ? 1 : 0],
-                                    (char)parser[must_swap ? 0 : 1], '\0' };
-                    section.push_back((uint8_t)strtoul(str, nullptr, 16));
-                    ++parser;
+                    uint32_t ins = (m_record[4 + j * 5 / 2 + 0] << 16)
+                                 | (m_record[4 + j * 5 / 2 + 1] << 8)
+                                 | (m_record[4 + j * 5 / 2 + 2]);
+                    // We read unaligned data; must realign it if j is odd
+                    ins = (j & 1) ? ins & 0xfffff : ins >> 4;
+
+                    sfx.notes[j].key = (ins & 0x3f000) >> 12;
+                    // Instruments 8…15 are SFX instruments
+                    sfx.notes[j].instrument = (ins & 0x700) >> 8;
+                    sfx.notes[j].custom = (ins & 0x800) >> 11;
+                    sfx.notes[j].volume = (ins & 0x70) >> 4;
+                    sfx.notes[j].effect = ins & 0x7;
                 }
+
+                sfx.editor_mode = m_record[0];
+                sfx.speed       = m_record[1];
+                sfx.loop_start  = m_record[2];
+                sfx.loop_end    = m_record[3];
             }
         }
+        break;
     }
-};
+    default:
+        break;
+    }
+
+    offset += size;
+}
 
 struct replacement
 {
@@ -320,121 +694,218 @@ private:
     char const *m_str;
 };
 
-bool cart::load_p8(std::string const &filename)
+bool cart::load_p8(std::string const &s)
 {
-    std::string s;
-    lol::File f;
-    for (auto const &candidate : lol::sys::get_path_list(filename))
-    {
-        f.Open(candidate, lol::FileAccess::Read);
-        if (f.IsValid())
-        {
-            s = f.ReadString();
-            f.Close();
-
-            msg::debug("loaded file %s\n", candidate.c_str());
-            break;
-        }
-    }
-
     if (s.length() == 0)
         return false;
 
-    p8_reader reader;
-    reader.parse(s.c_str());
+    memset(&m_rom, 0, sizeof(m_rom));
+    m_label.clear();
 
-    if (reader.m_version < 0)
+    // Hexadecimal data is decoded directly into the ROM and label
+    p8_reader reader(m_rom, m_label);
+    if (!reader.parse(s.data(), s.data() + s.size()))
         return false;
 
     // PICO-8 saves some symbols in the .p8 file as Emoji/Unicode characters
     // but the runtime expects 8-bit characters instead.
     m_code = charset::utf8_to_pico8(reader.m_code);
 
-    memset(&m_rom, 0, sizeof(m_rom));
-
-    auto const &gfx = reader.m_sections[(int8_t)p8_reader::section::gfx];
-    auto const &gff = reader.m_sections[(int8_t)p8_reader::section::gff];
-    auto const &map = reader.m_sections[(int8_t)p8_reader::section::map];
-    auto const &sfx = reader.m_sections[(int8_t)p8_reader::section::sfx];
-    auto const &mus = reader.m_sections[(int8_t)p8_reader::section::mus];
-    auto const &lab = reader.m_sections[(int8_t)p8_reader::section::lab];
+    auto const *count = reader.m_count;
+    using section = p8_reader::section;
 
     msg::debug("version: %d code: %d gfx: %d/%d gff: %d/%d map: %d/%d "
                "sfx: %d/%d mus: %d/%d lab: %d/%d\n",
                reader.m_version, (int)m_code.length(),
-               (int)gfx.size(), (int)sizeof(m_rom.gfx),
-               (int)gff.size(), (int)sizeof(m_rom.gfx_props),
-               (int)map.size(), (int)(sizeof(m_rom.map) + sizeof(m_rom.map2)),
-               (int)sfx.size() / (4 + 80) * (4 + 64), (int)sizeof(m_rom.sfx),
-               (int)mus.size() / 5 * 4, (int)sizeof(m_rom.song),
-               (int)lab.size(), LABEL_WIDTH * LABEL_HEIGHT / 2);
+               (int)count[(int)section::gfx], (int)sizeof(m_rom.gfx),
+               (int)count[(int)section::gff], (int)sizeof(m_rom.gfx_props),
+               (int)count[(int)section::map], (int)(sizeof(m_rom.map) + sizeof(m_rom.map2)),
+               (int)count[(int)section::sfx] / (4 + 80) * (4 + 64), (int)sizeof(m_rom.sfx),
+               (int)count[(int)section::mus] / 5 * 4, (int)sizeof(m_rom.song),
+               (int)count[(int)section::lab], LABEL_WIDTH * LABEL_HEIGHT / 2);
+
+    // Invalidate code cache
+    m_lua.resize(0);
+
+    return true;
+}
+
+//
+// Binary cart caches
+//
+// A cache file holds everything needed to start a cart without parsing
+// or decompressing anything:
+//
+//   offset  size
+//   0       4       magic "z8C\0"
+//   4       4       format version
+//   8       8       FNV-1a hash of the source cart file
+//   16      4       code size
+//   20      4       label size
+//   24      4       translated Lua code size
+//   28      4       reserved
+//   32      0x4300  ROM data
+//   …               code, label, translated Lua code
+//
+// Integers are little endian. The file is mapped into memory when the
+// platform allows it, so loading is little more than a few copies.
+//
+
+static uint8_t const cache_magic[] = { 'z', '8', 'C', '\0' };
+// Caches are keyed by the source hash only, so they also hold the output
+// of analyzer::fix(). Bump this whenever the file layout changes, and
+// whenever a change to the analyzer or to fix() alters the translated
+// code; otherwise carts keep running from stale translations.
+static uint32_t const cache_version = 1;
+static size_t const cache_header_size = 32;
+static size_t const cache_rom_size = offsetof(memory, code);
+
+static uint64_t get_le(uint8_t const *p, int bytes)
+{
+    uint64_t ret = 0;
+    for (int i = bytes; i--; )
+        ret = ret << 8 | p[i];
+    return ret;
+}
 
-    // The optional second chunk of gfx is contiguous, we can copy it directly
-    memcpy(&m_rom.gfx, gfx.data(), std::min(sizeof(m_rom.gfx), gfx.size()));
+static void put_le(std::vector<uint8_t> &v, uint64_t x, int bytes)
+{
+    for (int i = 0; i < bytes; ++i, x >>= 8)
+        v.push_back(uint8_t(x));
+}
 
-    memcpy(&m_rom.gfx_props, gff.data(), std::min(sizeof(m_rom.gfx_props), gff.size()));
+namespace
+{
 
-    // Map data + optional second chunk
-    memcpy(&m_rom.map, map.data(), std::min(sizeof(m_rom.map), map.size()));
-    if (map.size() > sizeof(m_rom.map))
+// A read-only view of a whole file
+class mapped_file
+{
+public:
+    mapped_file(std::string const &filename)
     {
-        size_t map2_count = std::min(sizeof(m_rom.map2),
-                                     map.size() - sizeof(m_rom.map));
-        // Use binary OR because some old versions of PICO-8 would store
-        // a full gfx+gfx2 section AND a full map+map2 section, so we cannot
-        // really decide which one is relevant.
-        for (size_t i = 0; i < map2_count; ++i)
-            m_rom.map2[i] |= map[sizeof(m_rom.map) + i];
+#if HAVE_SYS_MMAN_H
+        for (auto const &candidate : lol::sys::get_path_list(filename))
+        {
+            int fd = open(candidate.c_str(), O_RDONLY);
+            if (fd < 0)
+                continue;
+
+            struct stat st;
+            if (fstat(fd, &st) == 0 && st.st_size > 0)
+            {
+                void *p = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+                if (p != MAP_FAILED)
+                {
+                    m_data = (uint8_t const *)p;
+                    m_size = st.st_size;
+                }
+            }
+            close(fd);
+            break;
+        }
+#else
+        m_buffer = read_file(filename);
+        m_data = (uint8_t const *)m_buffer.data();
+        m_size = m_buffer.size();
+#endif
     }
 
-    // Song data is encoded slightly differently
-    size_t song_count = std::min(sizeof(m_rom.song) / 4,
-                                 mus.size() / 5);
-    for (size_t i = 0; i < song_count; ++i)
+    ~mapped_file()
     {
-        m_rom.song[i].data[0] = mus[i * 5 + 1] | ((mus[i * 5] << 7) & 0x80);
-        m_rom.song[i].data[1] = mus[i * 5 + 2] | ((mus[i * 5] << 6) & 0x80);
-        m_rom.song[i].data[2] = mus[i * 5 + 3] | ((mus[i * 5] << 5) & 0x80);
-        m_rom.song[i].data[3] = mus[i * 5 + 4] | ((mus[i * 5] << 4) & 0x80);
+#if HAVE_SYS_MMAN_H
+        if (m_data)
+            munmap((void *)m_data, m_size);
+#endif
     }
 
-    // SFX data is packed
-    size_t sfx_count = std::min(sizeof(m_rom.sfx) / (4 + 32 * 2),
-                                sfx.size() / (4 + 32 * 5 / 2));
-    for (size_t i = 0; i < sfx_count; ++i)
-    {
-        // FIXME move this to the parser maybe?
-        for (int j = 0; j < 32; ++j)
-        {
-            uint32_t ins = (sfx[4 + i * (4 + 80) + j * 5 / 2 + 0] << 16)
-                         | (sfx[4 + i * (4 + 80) + j * 5 / 2 + 1] << 8)
-                         | (sfx[4 + i * (4 + 80) + j * 5 / 2 + 2]);
-            // We read unaligned data; must realign it if j is odd
-            ins = (j & 1) ? ins & 0xfffff : ins >> 4;
-
-            m_rom.sfx[i].notes[j].key = (ins & 0x3f000) >> 12;
-            m_rom.sfx[i].notes[j].instrument = (ins & 0x700) >> 8;
-            m_rom.sfx[i].notes[j].volume = (ins & 0x70) >> 4;
-            m_rom.sfx[i].notes[j].effect = ins & 0xf;
-        }
+    uint8_t const *data() const { return m_data; }
+    size_t size() const { return m_size; }
 
-        m_rom.sfx[i].editor_mode = sfx[i * (4 + 32 * 5 / 2) + 0];
-        m_rom.sfx[i].speed       = sfx[i * (4 + 32 * 5 / 2) + 1];
-        m_rom.sfx[i].loop_start  = sfx[i * (4 + 32 * 5 / 2) + 2];
-        m_rom.sfx[i].loop_end    = sfx[i * (4 + 32 * 5 / 2) + 3];
+private:
+    uint8_t const *m_data = nullptr;
+    size_t m_size = 0;
+#if !HAVE_SYS_MMAN_H
+    std::string m_buffer;
+#endif
+};
+
+} // anonymous namespace
+
+bool cart::load_cache(std::string const &filename)
+{
+    mapped_file f(filename);
+    return load_cache(f.data(), f.size());
+}
+
+bool cart::load_cache(uint8_t const *p, size_t size)
+{
+    if (size < cache_header_size + cache_rom_size || memcmp(p, cache_magic, 4) != 0)
+        return false;
+
+    if (get_le(p + 4, 4) != cache_version)
+    {
+        msg::error("unsupported cart cache version %d\n", (int)get_le(p + 4, 4));
+        return false;
     }
 
-    // Optional cartridge label
-    m_label.resize(std::min(lab.size(), size_t(LABEL_WIDTH * LABEL_HEIGHT / 2)));
-    memcpy(m_label.data(), lab.data(), m_label.size());
+    size_t const code_size = get_le(p + 16, 4);
+    size_t const label_size = get_le(p + 20, 4);
+    size_t const lua_size = get_le(p + 24, 4);
+    if (size < cache_header_size + cache_rom_size + code_size + label_size + lua_size)
+        return false;
 
-    // Invalidate code cache
-    m_lua.resize(0);
+    uint8_t const *data = p + cache_header_size;
+    memcpy(&m_rom, data, cache_rom_size);
+    memset((uint8_t *)&m_rom + cache_rom_size, 0, sizeof(m_rom) - cache_rom_size);
+    data += cache_rom_size;
+
+    m_code.assign((char const *)data, code_size);
+    data += code_size;
+    m_label.assign(data, data + label_size);
+    data += label_size;
+    m_lua.assign((char const *)data, lua_size);
+    m_hash = get_le(p + 8, 8);
+
+    msg::debug("cache: code: %d label: %d lua: %d\n",
+               (int)code_size, (int)label_size, (int)lua_size);
 
     return true;
 }
 
-lol::image cart::get_png() const
+std::vector<uint8_t> cart::get_cache()
+{
+    auto const &lua = get_lua();
+
+    std::vector<uint8_t> ret(cache_magic, cache_magic + 4);
+    put_le(ret, cache_version, 4);
+    put_le(ret, m_hash, 8);
+    put_le(ret, m_code.length(), 4);
+    put_le(ret, m_label.size(), 4);
+    put_le(ret, lua.length(), 4);
+    put_le(ret, 0, 4);
+
+    uint8_t const *rom = (uint8_t const *)&m_rom;
+    ret.insert(ret.end(), rom, rom + cache_rom_size);
+    ret.insert(ret.end(), m_code.begin(), m_code.end());
+    ret.insert(ret.end(), m_label.begin(), m_label.end());
+    ret.insert(ret.end(), lua.begin(), lua.end());
+
+    return ret;
+}
+
+lol::image cart::get_png(bool use_pxa) const
+{
+    std::lock_guard<std::mutex> lock(image_mutex);
+    return make_png(use_pxa);
+}
+
+bool cart::save_png(std::string const &filename, bool use_pxa) const
+{
+    std::lock_guard<std::mutex> lock(image_mutex);
+    return make_png(use_pxa).save(filename);
+}
+
+lol::image cart::make_png(bool use_pxa) const
 {
     lol::image ret;
     ret.load("data/blank.png");
@@ -455,7 +926,7 @@ lol::image cart::get_png() const
     }
 
     /* Create ROM data */
-    std::vector<uint8_t> const &rom = get_bin();
+    std::vector<uint8_t> const &rom = get_bin(use_pxa);
 
     /* Write ROM to lower image bits */
     for (size_t n = 0; n < rom.size(); ++n)
@@ -473,70 +944,119 @@ std::vector<uint8_t> cart::get_compressed_code() const
 {
     std::vector<uint8_t> ret;
 
-    /* Ensure the compression LUT is initialised */
-    if (!compress_lut)
+    /* Initialised once, even when several threads get here */
+    static uint8_t const *compress_lut = []()
     {
-        uint8_t *tmp = new uint8_t[256];
-        memset(tmp, 0, 256);
+        static uint8_t ret[256] = { 0 };
         for (int i = 0; i < 0x3b; ++i)
-            tmp[(uint8_t)decompress_lut[i]] = i + 1;
-        compress_lut = tmp;
-    }
+            ret[(uint8_t)decompress_lut[i]] = i + 1;
+        return ret;
+    }();
 
     /* FIXME: PICO-8 appears to be adding an implicit \n at the
      * end of the code, and ignoring it when compressing code. So
      * for the moment we write one char too many. */
-    for (int i = 0; i < (int)m_code.length(); ++i)
+    uint8_t const *code = (uint8_t const *)m_code.data();
+    int const n = (int)m_code.length();
+
+    /* Back references span 2 to 17 bytes, up to 3135 bytes behind. */
+    int const max_len = 17, max_dist = 3135;
+
+    /* Find the longest match at each position. Candidates are found
+     * through hash chains on the next 3 bytes; for 2-byte matches we
+     * only need any previous occurrence of the byte pair, so keep the
+     * last position of each pair instead of walking a second chain.
+     *
+     * XXX: official PICO-8 never lets a match overlap the current
+     * position, despite the decoder supporting it, so neither do we. */
+    std::vector<uint8_t> match_len(n + 1, 0);
+    std::vector<uint16_t> match_dist(n + 1, 0);
+    std::vector<int> head3(0x10000, -1), chain3(n, -1);
+    std::vector<int> head2(0x10000, -1), chain2(n, -1);
+
+    for (int i = 0; i + 1 < n; ++i)
     {
-        /* Look behind for possible patterns */
-        int best_j = 0, best_len = 0;
-        for (int j = lol::max(i - 3135, 0); j < i; ++j)
-        {
-            int end = std::min((int)m_code.length() - j, 17);
-
-            /* XXX: official PICO-8 stops at i - j, despite being able
-             * to support m_code.length() - j, it seems. */
-            end = std::min(end, i - j);
+        int const pair = code[i] << 8 | code[i + 1];
+        int const hash = i + 2 < n ? (pair * 0x9e5 + code[i + 2] * 0x3f) & 0xffff : -1;
+        int best_len = 0, best_dist = 0;
 
-            for (int k = 0; ; ++k)
+        if (hash >= 0)
+        {
+            for (int j = head3[hash]; j >= 0 && i - j <= max_dist; j = chain3[j])
             {
-                if (k >= end || m_code[j + k] != m_code[i + k])
+                int end = std::min(std::min(max_len, n - i), i - j);
+                if (end <= best_len || code[j + best_len] != code[i + best_len])
+                    continue;
+                int k = 0;
+                while (k < end && code[j + k] == code[i + k])
+                    ++k;
+                if (k > best_len)
                 {
-                    if (k > best_len)
-                    {
-                        best_j = j;
-                        best_len = k;
-                    }
-                    break;
+                    best_len = k;
+                    best_dist = i - j;
+                    if (k == max_len)
+                        break;
                 }
             }
         }
 
-        uint8_t byte = (uint8_t)m_code[i];
-
-        /* If best length is 2, it may or may not be interesting to emit a back
-         * reference. Most of the time, if the first character fits in a single
-         * byte, we should emit it directly. And if the first character needs
-         * to be escaped, we should always emit a back reference of length 2.
-         *
-         * However there is at least one suboptimal case with preexisting
-         * sequences “ab”, “b-”, and “-c-”. Then the sequence “ab-c-” can be
-         * encoded as “a” “b-” “c-” (5 bytes) or as “ab” “-c-” (4 bytes).
-         * Clearly it is more interesting to encode “ab” as a two-byte back
-         * reference. But since this case is statistically rare, we ignore
-         * it and accept that compression could be more efficient.
-         *
-         * If it can be a relief, PICO-8 is a lot less good than us at this. */
-        if (compress_lut[byte] && best_len <= 2)
+        if (best_len < 2)
         {
-            ret.push_back(compress_lut[byte]);
+            int j = head2[pair];
+            if (j >= 0 && j == i - 1)
+                j = chain2[j];
+            if (j >= 0 && i - j <= max_dist)
+            {
+                best_len = 2;
+                best_dist = i - j;
+            }
         }
-        else if (best_len >= 2)
+
+        match_len[i] = uint8_t(best_len);
+        match_dist[i] = uint16_t(best_dist);
+
+        chain2[i] = head2[pair];
+        head2[pair] = i;
+        if (hash >= 0)
         {
-            uint8_t a = 0x3c + (i - best_j) / 16;
-            uint8_t b = ((i - best_j) & 0xf) + (best_len - 2) * 16;
+            chain3[i] = head3[hash];
+            head3[hash] = i;
+        }
+    }
+
+    /* Every token costs one or two bytes, so find the cheapest parse with
+     * a backwards pass: cost[i] is the size of the encoded suffix at i,
+     * and step[i] is the length of the token chosen there (1 = literal). */
+    std::vector<int> cost(n + 1, 0);
+    std::vector<uint8_t> step(n + 1, 1);
+    for (int i = n; i-- > 0; )
+    {
+        cost[i] = (compress_lut[code[i]] ? 1 : 2) + cost[i + 1];
+        for (int len = 2; len <= match_len[i]; ++len)
+        {
+            if (2 + cost[i + len] < cost[i])
+            {
+                cost[i] = 2 + cost[i + len];
+                step[i] = uint8_t(len);
+            }
+        }
+    }
+
+    ret.reserve(cost[0]);
+    for (int i = 0; i < n; i += step[i])
+    {
+        uint8_t byte = code[i];
+
+        if (step[i] >= 2)
+        {
+            int const dist = match_dist[i];
+            uint8_t a = 0x3c + dist / 16;
+            uint8_t b = (dist & 0xf) + (step[i] - 2) * 16;
             ret.insert(ret.end(), { a, b });
-            i += best_len - 1;
+        }
+        else if (compress_lut[byte])
+        {
+            ret.push_back(compress_lut[byte]);
         }
         else
         {
@@ -550,7 +1070,7 @@ std::vector<uint8_t> cart::get_compressed_code() const
     return ret;
 }
 
-std::vector<uint8_t> cart::get_bin() const
+std::vector<uint8_t> cart::get_bin(bool use_pxa) const
 {
     int const data_size = offsetof(memory, code);
 
@@ -560,15 +1080,20 @@ std::vector<uint8_t> cart::get_bin() const
     ret.resize(data_size);
     memcpy(ret.data(), &m_rom, data_size);
 
-    ret.insert(ret.end(),
+    if (!use_pxa)
     {
-        ':', 'c', ':', '\0',
-        (uint8_t)(m_code.length() >> 8),
-        (uint8_t)m_code.length(),
-        0, 0 /* FIXME: what is this? */
-    });
+        ret.insert(ret.end(),
+        {
+            ':', 'c', ':', '\0',
+            (uint8_t)(m_code.length() >> 8),
+            (uint8_t)m_code.length(),
+            0, 0 /* FIXME: what is this? */
+        });
+    }
 
-    auto const &code = get_compressed_code();
+    auto const &code = use_pxa ? pxa::compress(m_code) : get_compressed_code();
+    if (use_pxa && code.empty())
+        msg::error("code is too large for PXA: %d bytes\n", (int)m_code.length());
     ret.insert(ret.end(), code.begin(), code.end());
 
     int const rom_size = (int)sizeof(m_rom);
@@ -576,7 +1101,8 @@ std::vector<uint8_t> cart::get_bin() const
                (int)ret.size() - data_size, rom_size - data_size);
     ret.resize(rom_size);
 
-    ret.push_back(PICO8_VERSION);
+    /* Older PICO-8 versions would not know how to decode PXA */
+    ret.push_back(use_pxa ? PICO8_PXA_VERSION : PICO8_VERSION);
 
     return ret;
 }
@@ -675,9 +1201,10 @@ std::string cart::get_p8() const
         for (int j = 0; j < 64; j += 2)
         {
             int pitch = data[j] & 0x3f;
-            int instrument = ((data[j + 1] << 2) & 0x4) | (data[j] >> 6);
+            int instrument = ((data[j + 1] >> 4) & 0x8)
+                           | ((data[j + 1] << 2) & 0x4) | (data[j] >> 6);
             int volume = (data[j + 1] >> 1) & 0x7;
-            int effect = (data[j + 1] >> 4) & 0xf;
+            int effect = (data[j + 1] >> 4) & 0x7;
             ret += lol::format("%02x%1x%1x%1x", pitch, instrument, volume, effect);
         }
 
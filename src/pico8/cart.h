@@ -22,7 +22,8 @@
 // The cart class
 // ——————————————
 // Represents a PICO-8 cartridge. Can load and unpack .p8 and .p8.png files,
-// so that the VM can then load their content into memory.
+// as well as binary caches of either, so that the VM can then load their
+// content into memory.
 
 namespace z8::pico8
 {
@@ -35,6 +36,10 @@ public:
 
     bool load(std::string const &filename);
 
+    // Directory where load() looks for a cache of each cart it parses,
+    // named after the hash of its source; empty to disable the lookup
+    static void set_cache_dir(std::string const &dir);
+
     memory const &get_rom() const
     {
         return m_rom;
@@ -62,18 +67,41 @@ public:
         return m_lua;
     }
 
+    // A hash of the source file the cart was loaded from
+    uint64_t get_hash() const
+    {
+        return m_hash;
+    }
+
     std::vector<uint8_t> get_compressed_code() const;
-    std::vector<uint8_t> get_bin() const;
+    std::vector<uint8_t> get_cache();
+
+    // Default file name of the cart cache, in the cache directory if any
+    std::string get_cache_name() const;
+
+    // The code is stored in the legacy “:c:” format unless use_pxa is set;
+    // PXA carts are smaller but need PICO-8 0.2.0 or later.
+    std::vector<uint8_t> get_bin(bool use_pxa = false) const;
+
+    // Load the ROM data and version bytes returned by get_bin(), decoding
+    // the code the same way as for a .p8.png cart
+    bool load_bin(std::vector<uint8_t> const &bin);
+
     std::string get_p8() const;
-    lol::image get_png() const;
+    lol::image get_png(bool use_pxa = false) const;
+    bool save_png(std::string const &filename, bool use_pxa = false) const;
 
 private:
-    bool load_png(std::string const &filename);
-    bool load_p8(std::string const &filename);
+    bool load_cache(std::string const &filename);
+    bool load_cache(uint8_t const *data, size_t size);
+    bool load_png(std::string const &filename, std::string const &data);
+    bool load_p8(std::string const &data);
+    lol::image make_png(bool use_pxa) const;
 
     memory m_rom;
     std::vector<uint8_t> m_label;
     std::string m_code, m_lua;
+    uint64_t m_hash = 0;
     int m_version;
 };
 
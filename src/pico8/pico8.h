@@ -27,6 +27,8 @@ namespace z8::pico8
 enum
 {
     PICO8_VERSION = 16,
+    // First cart version with PXA compressed code (PICO-8 0.2.0)
+    PICO8_PXA_VERSION = 29,
 };
 
 enum
@@ -101,7 +101,7 @@ std::string charset::utf8_to_pico8(std::string const &str)
              && std::regex_search(p, str.end(), sm, utf8_regex)
              && sm.length() > 1)
         {
-            ret += to_pico8[sm.str()];
+            ret += to_pico8.at(sm.str());
             p += sm.length();
         }
         else
@@ -0,0 +1,273 @@
+//
+//  ZEPTO-8 — Fantasy console emulator
+//
+//  Copyright © 2016—2020 Sam Hocevar <sam@hocevar.net>
+//
+//  This program is free software. It comes without any warranty, to
+//  the extent permitted by applicable law. You can redistribute it
+//  and/or modify it under the terms of the Do What the Fuck You Want
+//  to Public License, Version 2, as published by the WTFPL Task Force.
+//  See http://www.wtfpl.net/ for more details.
+//
+
+#if HAVE_CONFIG_H
+#   include "config.h"
+#endif
+
+#include <algorithm>
+#include <cstring>
+
+#include "bits.h"
+#include "pico8/pxa.h"
+
+// The PXA stream
+// ——————————————
+//  1 ⟨n×1⟩ 0 ⟨4+n bits⟩      literal: index (2^(4+n)-16)+bits in the
+//                            move-to-front list of byte values
+//  0 ⟨1 1|1 0|0⟩ ⟨offset⟩    back reference: offset-1 on 5, 10 or 15
+//    ⟨3 bits⟩…               bits, then length-3 as a sum of 3-bit
+//                            chunks, ending with a chunk that is not 7
+//  0 1 0 ⟨10×0⟩ ⟨bytes⟩ 0    raw bytes, up to a zero byte
+//
+// Only literals update the move-to-front list.
+
+namespace z8::pico8
+{
+
+static int const min_match = 3;
+static int const max_offset = 32768;
+
+static int literal_bits(int index)
+{
+    int n = 0;
+    while (index >= (32 << n) - 16)
+        ++n;
+    return 1 + (n + 1) + (4 + n);
+}
+
+static int match_bits(int len, int offset)
+{
+    int bits = offset <= 32 ? 2 + 5 : offset <= 1024 ? 2 + 10 : 1 + 15;
+    return 1 + bits + 3 * ((len - min_match) / 7 + 1);
+}
+
+bool pxa::is_pxa(uint8_t const *data, size_t size)
+{
+    return size >= 8 && memcmp(data, "\0pxa", 4) == 0;
+}
+
+std::vector<uint8_t> pxa::compress(std::string const &input)
+{
+    // Both sizes are stored on 16 bits in the header
+    if (input.size() > 0xffff)
+        return {};
+
+    uint8_t const *code = (uint8_t const *)input.data();
+    int const n = (int)input.size();
+
+    // Matches are found using hash chains on the next 3 bytes. Chain walks
+    // are bounded, and stop early on long matches. Only the positions
+    // visited by the parser are searched, but all of them are indexed.
+    int const hash_bits = 15, max_chain = 256, nice_len = 128;
+    std::vector<int> head(1 << hash_bits, -1), chain(n, -1);
+    int indexed = 0;
+
+    auto hash = [&](int i)
+    {
+        return (code[i] << 16 | code[i + 1] << 8 | code[i + 2]) * 0x9e3779b1u
+                >> (32 - hash_bits);
+    };
+
+    auto find = [&](int i, int &offset)
+    {
+        for (; indexed < i && indexed + min_match <= n; ++indexed)
+        {
+            uint32_t h = hash(indexed);
+            chain[indexed] = head[h];
+            head[h] = indexed;
+        }
+
+        if (i + min_match > n)
+            return 0;
+
+        int best_len = 0, depth = max_chain;
+        for (int j = head[hash(i)]; j >= 0 && i - j <= max_offset && depth--; j = chain[j])
+        {
+            if (code[j + best_len] != code[i + best_len])
+                continue;
+            int k = 0;
+            while (i + k < n && code[j + k] == code[i + k])
+                ++k;
+            if (k > best_len)
+            {
+                best_len = k;
+                offset = i - j;
+                if (k >= nice_len || i + k == n)
+                    break;
+            }
+        }
+
+        return best_len >= min_match ? best_len : 0;
+    };
+
+    std::vector<uint8_t> ret =
+    {
+        '\0', 'p', 'x', 'a',
+        uint8_t(n >> 8), uint8_t(n), 0, 0, // compressed size is filled below
+    };
+
+    bit_writer bw(ret);
+
+    // Move-to-front list and its inverse
+    uint8_t mtf[256], pos[256];
+    for (int i = 0; i < 256; ++i)
+        mtf[i] = pos[i] = uint8_t(i);
+
+    int next_offset = 0, next_len = find(0, next_offset);
+
+    for (int i = 0; i < n; )
+    {
+        int len = next_len, offset = next_offset;
+
+        // Only use a back reference if it is cheaper than literals, and
+        // defer it if the next position has a longer match (lazy parsing).
+        next_len = 0;
+        if (len >= min_match)
+        {
+            int bits = 0;
+            for (int k = 0; k < len; ++k)
+                bits += literal_bits(pos[code[i + k]]);
+            if (bits <= match_bits(len, offset))
+                len = 0;
+            else if ((next_len = find(i + 1, next_offset)) > len)
+                len = 0;
+        }
+
+        if (len >= min_match)
+        {
+            bw.put(0, 1);
+            if (offset <= 32)
+                bw.put(0x3, 2), bw.put(offset - 1, 5);
+            else if (offset <= 1024)
+                bw.put(0x1, 2), bw.put(offset - 1, 10);
+            else
+                bw.put(0x0, 1), bw.put(offset - 1, 15);
+
+            for (int left = len - min_match; ; left -= 7)
+            {
+                bw.put(std::min(left, 7), 3);
+                if (left < 7)
+                    break;
+            }
+
+            i += len;
+            next_len = find(i, next_offset);
+        }
+        else
+        {
+            uint8_t ch = code[i++];
+            int index = pos[ch], extra = 0;
+            while (index >= (32 << extra) - 16)
+                ++extra;
+
+            bw.put(1, 1);
+            bw.put((1 << extra) - 1, extra + 1); // unary, ending with a zero
+            bw.put(index - ((16 << extra) - 16), 4 + extra);
+
+            for (int k = index; k > 0; --k)
+            {
+                mtf[k] = mtf[k - 1];
+                pos[mtf[k]] = uint8_t(k);
+            }
+            mtf[0] = ch;
+            pos[ch] = 0;
+
+            if (!next_len)
+                next_len = find(i, next_offset);
+        }
+    }
+
+    bw.flush();
+
+    if (ret.size() > 0xffff)
+        return {};
+
+    ret[6] = uint8_t(ret.size() >> 8);
+    ret[7] = uint8_t(ret.size());
+
+    return ret;
+}
+
+bool pxa::decompress(uint8_t const *data, size_t size, std::string &output)
+{
+    if (!is_pxa(data, size))
+        return false;
+
+    size_t const length = data[4] << 8 | data[5];
+    size_t const compressed = data[6] << 8 | data[7];
+    if (compressed < 8 || size < 8)
+        return false;
+
+    bit_reader br(data + 8, std::min(size, compressed) - 8);
+
+    uint8_t mtf[256];
+    for (int i = 0; i < 256; ++i)
+        mtf[i] = uint8_t(i);
+
+    output.clear();
+    output.reserve(length);
+
+    while (output.size() < length)
+    {
+        if (br.overrun())
+            return false;
+
+        if (br.get(1))
+        {
+            int nbits = 4;
+            while (br.get(1))
+                if (++nbits > 8)
+                    return false;
+
+            int index = br.get(nbits) + (1 << nbits) - 16;
+            if (index > 255)
+                return false;
+
+            uint8_t ch = mtf[index];
+            memmove(mtf + 1, mtf, index);
+            mtf[0] = ch;
+            output += char(ch);
+        }
+        else
+        {
+            int nbits = br.get(1) ? br.get(1) ? 5 : 10 : 15;
+            size_t offset = br.get(nbits) + 1;
+
+            if (nbits == 10 && offset == 1)
+            {
+                // Raw block
+                for (uint8_t ch; (ch = uint8_t(br.get(8))) && !br.overrun(); )
+                    output += char(ch);
+            }
+            else
+            {
+                size_t len = min_match;
+                for (int chunk = 7; chunk == 7; len += chunk)
+                    chunk = br.get(3);
+
+                if (offset > output.size())
+                    return false;
+
+                // Copies may overlap, so go byte by byte
+                for (size_t from = output.size() - offset; len--; )
+                    output += output[from++];
+            }
+        }
+    }
+
+    output.resize(length);
+    return !br.overrun();
+}
+
+} // namespace z8::pico8
+
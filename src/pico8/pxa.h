@@ -0,0 +1,41 @@
+//
+//  ZEPTO-8 — Fantasy console emulator
+//
+//  Copyright © 2016—2020 Sam Hocevar <sam@hocevar.net>
+//
+//  This program is free software. It comes without any warranty, to
+//  the extent permitted by applicable law. You can redistribute it
+//  and/or modify it under the terms of the Do What the Fuck You Want
+//  to Public License, Version 2, as published by the WTFPL Task Force.
+//  See http://www.wtfpl.net/ for more details.
+//
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace z8::pico8
+{
+
+// The PXA code compression format used by PICO-8 since version 0.2.0:
+// an 8-byte header ("\0pxa", then the big-endian decompressed and
+// compressed sizes) followed by a bit stream of move-to-front coded
+// literals and back references.
+struct pxa
+{
+    // Check whether data starts with a PXA header
+    static bool is_pxa(uint8_t const *data, size_t size);
+
+    // Compress code, including the header; returns an empty vector if the
+    // code or its compressed form is too large for the 16-bit header sizes
+    static std::vector<uint8_t> compress(std::string const &input);
+
+    // Decompress PXA data into output; returns false if the data is invalid
+    static bool decompress(uint8_t const *data, size_t size, std::string &output);
+};
+
+} // namespace z8::pico8
+
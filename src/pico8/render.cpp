@@ -24,20 +24,19 @@ namespace z8::pico8
 
 using lol::msg;
 
-void vm::render(lol::u8vec4 *screen) const
+static void render_screen(lol::u8vec4 *screen, u4mat2<128, 128> const &src,
+                          uint8_t const *pal)
 {
-    auto &ds = m_ram.draw_state;
-
     /* Precompute the current palette for pairs of pixels */
     struct { u8vec4 a, b; } lut[256];
     for (int n = 0; n < 256; ++n)
     {
-        lut[n].a = palette::get8(ds.pal[1][n % 16]);
-        lut[n].b = palette::get8(ds.pal[1][n / 16]);
+        lut[n].a = palette::get8(pal[n % 16]);
+        lut[n].b = palette::get8(pal[n / 16]);
     }
 
     /* Render actual screen */
-    for (auto const &line : m_ram.screen.data)
+    for (auto const &line : src.data)
     for (uint8_t p : line)
     {
         *screen++ = lut[p].a;
@@ -45,6 +44,24 @@ void vm::render(lol::u8vec4 *screen) const
     }
 }
 
+void vm::render(lol::u8vec4 *screen) const
+{
+    render_screen(screen, m_ram.screen, m_ram.draw_state.pal[1]);
+}
+
+void vm::render(lol::u8vec4 *screen, frame const &f) const
+{
+    // The render state is the screen palette, see get_render_state()
+    render_screen(screen, f.screen, f.state);
+}
+
+std::tuple<uint8_t const *, size_t> vm::get_render_state() const
+{
+    // Only the screen palette is used by render()
+    auto &pal = m_ram.draw_state.pal[1];
+    return std::make_tuple(&pal[0], sizeof(pal));
+}
+
 int vm::get_ansi_color(uint8_t c) const
 {
     static int const ansi_palette[] =
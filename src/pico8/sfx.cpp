@@ -22,8 +22,6 @@
 namespace z8::pico8
 {
 
-#define DEBUG_EXPORT_WAV 0
-
 using lol::msg;
 
 enum
@@ -43,6 +41,9 @@ static float key_to_freq(float key)
     return 440.f * std::exp2((key - 33.f) / 12.f);
 }
 
+// SFX instruments play at their own pitch for the note C-2
+static float const c2_freq = key_to_freq(24);
+
 #if DEBUG_STUFF
 static std::string key_to_name(float key)
 {
@@ -66,181 +67,499 @@ uint8_t song::sfx(int n) const
     return data[n] & 0x7f;
 }
 
-#if DEBUG_EXPORT_WAV
-std::map<void const *, FILE *> exports;
-#endif
-
-vm::channel::channel()
-{
-#if DEBUG_EXPORT_WAV
-    static int count = 0;
-    char const *header = "RIFF" "\xe4\xc1\x08\0" /* chunk size */ "WAVEfmt "
-        "\x10\0\0\0" /* subchunk size */ "\x01\0" /* format (PCM) */
-        "\x01\0" /* channels (1) */ "\x22\x56\0\0" /* sample rate (22050) */
-        "\x22\x56\0\0" /* byte rate */ "\x02\0" /* block align (2) */
-        "\x10\0" /* bits per sample (16) */ "data"
-        "\xc0\xc1\x08\00" /* bytes in data */;
-    exports[this] = fopen(lol::format("/tmp/zepto8_%d.wav", count++).c_str(), "w+");
-    fwrite(header, 44, 1, exports[this]);
-#endif
-}
-
-std::function<void(void *, int)> vm::get_streamer(int ch)
+std::function<void(void *, int)> vm::get_streamer(int sample_rate)
 {
     using namespace std::placeholders;
-    // Return a function that calls getaudio() with channel as first arg
-    return std::bind(&vm::getaudio, this, ch, _1, _2);
+    m_sample_rate = sample_rate;
+
+    // Effect parameters that only depend on the sample rate. The reverb
+    // delay (about 16.6 ms) and the lowpass cutoff are rough guesses.
+    m_reverb_delay = lol::clamp(sample_rate * 366 / 22050, 1, max_delay);
+    m_lowpass_coeff = 1.f - std::exp(-2.f * lol::F_PI * 2000.f / sample_rate);
+
+    return std::bind(&vm::getaudio, this, _1, _2);
 }
 
-// FIXME: there is a problem with the per-channel approach; if a channel
-// advances the music, then all the other channels will reference the
-// new music chunk. Be careful when implementing music.
-void vm::getaudio(int chan, void *in_buffer, int in_bytes)
+void vm::getaudio(void *in_buffer, int in_bytes)
 {
-    int const samples_per_second = 22050;
     int const bytes_per_sample = 2; // mono S16 for now
 
     int16_t *buffer = (int16_t *)in_buffer;
     int const samples = in_bytes / bytes_per_sample;
 
-    for (int i = 0; i < samples; ++i)
+    // Apply commands sent by the VM since the last block
+    for (audio_command cmd; m_audio_commands.pop(cmd); )
+    {
+        if (cmd.type == audio_command::type::sfx)
+            do_sfx(cmd.args[0], cmd.args[1], cmd.args[2]);
+        else
+            do_music(cmd.args[0], cmd.args[1], cmd.args[2]);
+    }
+
+    for (int start = 0; start < samples; start += block_size)
     {
-        if (m_channels[chan].m_sfx == -1)
+        int const count = lol::min(block_size, samples - start);
+
+        // Hardware effect bits are only read once per block
+        hw_state const hw = m_ram.hw_state;
+
+        for (int i = 0; i < count; ++i)
         {
-            buffer[i] = 0;
-            continue;
+            // Advance the music sequencer before synthesis, so that new
+            // patterns start exactly on the sample where the previous one
+            // ended.
+            if (m_music.m_pattern >= 0)
+                update_music(hw.half_rate);
+
+            for (int chan = 0; chan < 4; ++chan)
+                m_channels[chan].m_buffer[i] = get_sample(chan, hw.half_rate & (1 << chan));
         }
 
-        int const index = m_channels[chan].m_sfx;
-        ASSERT(index >= 0 && index < 64);
-        struct sfx const &sfx = m_ram.sfx[index];
+        for (int chan = 0; chan < 4; ++chan)
+            apply_effects(chan, hw, count);
 
-        // Speed must be 1—255 otherwise the SFX is invalid
-        int const speed = lol::max(1, (int)sfx.speed);
+        for (int i = 0; i < count; ++i)
+        {
+            float sample = m_channels[0].m_buffer[i] + m_channels[1].m_buffer[i]
+                         + m_channels[2].m_buffer[i] + m_channels[3].m_buffer[i];
+            buffer[start + i] = (int16_t)lol::clamp(sample * 32767.99f, -32768.f, 32767.f);
+        }
+    }
+
+    // Publish channel and music status
+    auto &status = m_audio_status;
+    for (int chan = 0; chan < 4; ++chan)
+    {
+        auto const &ch = m_channels[chan];
+        status.sfx[chan].store(ch.m_sfx, std::memory_order_relaxed);
+        status.note[chan].store(ch.m_sfx == -1 ? -1 : (int16_t)ch.m_offset,
+                                std::memory_order_relaxed);
+    }
+    status.pattern.store(m_music.m_pattern, std::memory_order_relaxed);
+    status.count.store(m_music.m_count, std::memory_order_relaxed);
+    status.ticks.store(m_music.m_pattern == -1 ? 0
+                        : (int16_t)(m_music.m_offset * m_music.m_speed),
+                       std::memory_order_relaxed);
+}
 
-        float offset = m_channels[chan].m_offset;
-        float phi = m_channels[chan].m_phi;
+void vm::apply_effects(int chan, hw_state const &hw, int count)
+{
+    auto &ch = m_channels[chan];
+    float *buf = ch.m_buffer;
+    int const bit = 1 << chan;
 
-        // PICO-8 exports instruments as 22050 Hz WAV files with 183 samples
-        // per speed unit per note, so this is how much we should advance
-        float const offset_per_second = 22050.f / (183.f * speed);
-        float const offset_per_sample = offset_per_second / samples_per_second;
-        float next_offset = offset + offset_per_sample;
+    if (hw.distort & bit)
+    {
+        // Quantise to 16 levels, then amplify a bit
+        for (int i = 0; i < count; ++i)
+            buf[i] = std::trunc(buf[i] * 8.f) * (0x1249 / 32768.f);
+    }
+
+    if (hw.lowpass & bit)
+    {
+        // One-pole lowpass filter
+        float y = ch.m_lowpass;
+        for (int i = 0; i < count; ++i)
+            buf[i] = y += m_lowpass_coeff * (buf[i] - y);
+        ch.m_lowpass = y;
+    }
+    else
+    {
+        // Track the signal so that enabling the filter does not click
+        ch.m_lowpass = buf[count - 1];
+    }
 
-        // Handle SFX loops. From the documentation: “Looping is turned
-        // off when the start index >= end index”.
-        float const loop_range = float(sfx.loop_end - sfx.loop_start);
-        if (loop_range > 0.f && next_offset >= sfx.loop_end
-             && m_channels[chan].m_can_loop)
+    if (hw.reverb & bit)
+    {
+        // Feedback comb filter over the preallocated delay line
+        if (!ch.m_reverb)
         {
-            next_offset = std::fmod(next_offset - sfx.loop_start, loop_range)
-                        + sfx.loop_start;
+            std::fill(ch.m_delay, ch.m_delay + max_delay, 0.f);
+            ch.m_delay_pos = 0;
+            ch.m_reverb = true;
         }
 
-        int const note_id = (int)lol::floor(offset);
-        int const next_note_id = (int)lol::floor(next_offset);
+        int pos = ch.m_delay_pos;
+        for (int i = 0; i < count; ++i)
+        {
+            buf[i] += 0.4f * ch.m_delay[pos];
+            ch.m_delay[pos] = buf[i];
+            if (++pos >= m_reverb_delay)
+                pos = 0;
+        }
+        ch.m_delay_pos = pos;
+    }
+    else
+    {
+        ch.m_reverb = false;
+    }
+}
 
-        uint8_t key = sfx.notes[note_id].key;
-        float volume = sfx.notes[note_id].volume / 7.f;
-        float freq = key_to_freq(key);
+void vm::update_music(uint8_t half_rate)
+{
+    auto &music = m_music;
 
-        if (volume == 0.f)
+    // Handle fading; the song stops when fading out is complete
+    if (music.m_volume_step)
+    {
+        music.m_volume += music.m_volume_step;
+        if (music.m_volume >= 1.f)
         {
-            // Play silence
-            buffer[i] = 0;
+            music.m_volume = 1.f;
+            music.m_volume_step = 0.f;
         }
-        else
+        else if (music.m_volume <= 0.f)
         {
-            int const fx = sfx.notes[note_id].effect;
+            stop_music();
+            return;
+        }
+    }
 
-            // Apply effect, if any
-            switch (fx)
-            {
-                case FX_NO_EFFECT:
-                    break;
-                case FX_SLIDE:
-                {
-                    float t = lol::fmod(offset, 1.f);
-                    // From the documentation: “Slide to the next note and volume”,
-                    // but it’s actually _from_ the _prev_ note and volume.
-                    freq = lol::mix(key_to_freq(m_channels[chan].m_prev_key), freq, t);
-                    if (m_channels[chan].m_prev_vol > 0.f)
-                        volume = lol::mix(m_channels[chan].m_prev_vol, volume, t);
-                    break;
-                }
-                case FX_VIBRATO:
-                {
-                    // 7.5f and 0.25f were found empirically by matching
-                    // frequency graphs of PICO-8 instruments.
-                    float t = lol::abs(lol::fmod(7.5f * offset / offset_per_second, 1.0f) - 0.5f) - 0.25f;
-                    // Vibrato half a semi-tone, so multiply by pow(2,1/12)
-                    freq = lol::mix(freq, freq * 1.059463094359f, t);
-                    break;
-                }
-                case FX_DROP:
-                    freq *= 1.f - lol::fmod(offset, 1.f);
-                    break;
-                case FX_FADE_IN:
-                    volume *= lol::fmod(offset, 1.f);
-                    break;
-                case FX_FADE_OUT:
-                    volume *= 1.f - lol::fmod(offset, 1.f);
-                    break;
-                case FX_ARP_FAST:
-                case FX_ARP_SLOW:
-                {
-                    // From the documentation:
-                    // “6 arpeggio fast  //  Iterate over groups of 4 notes at speed of 4
-                    //  7 arpeggio slow  //  Iterate over groups of 4 notes at speed of 8”
-                    // “If the SFX speed is <= 8, arpeggio speeds are halved to 2, 4”
-                    int const m = (speed <= 8 ? 32 : 16) / (fx == FX_ARP_FAST ? 4 : 8);
-                    int const n = (int)(m * 7.5f * offset / offset_per_second);
-                    int const arp_note = (note_id & ~3) | (n & 3);
-                    freq = key_to_freq(sfx.notes[arp_note].key);
+    if (music.m_offset >= 32.f)
+    {
+        // The current pattern is over: stop, loop or go to the next one
+        int next = music.m_pattern + 1;
+        uint8_t const flags = m_ram.song[music.m_pattern].flags();
+
+        if (flags & 0x4)
+            next = -1;
+        else if (flags & 0x2)
+        {
+            for (next = music.m_pattern; next > 0; --next)
+                if (m_ram.song[next].flags() & 0x1)
                     break;
-                }
-            }
+        }
 
-            // Play note
-            float waveform = synth::waveform(sfx.notes[note_id].instrument, phi);
+        if (next > 63 || !start_pattern(next))
+        {
+            stop_music();
+            return;
+        }
+
+        ++music.m_count;
+    }
+
+    // Follow the leading channel, which plays at half speed in half-rate
+    // mode, so that the pattern does not end before its SFX does
+    float const rate = (half_rate & (1 << music.m_lead)) ? 0.5f : 1.f;
+    music.m_offset += 22050.f / (183.f * music.m_speed) / m_sample_rate * rate;
+}
+
+bool vm::start_pattern(int pattern)
+{
+    if (pattern < 0)
+        return false;
+
+    auto &music = m_music;
+    auto const &song = m_ram.song[pattern];
+
+    // The pattern length is that of the leftmost non-looping SFX; if all
+    // SFX loop, the slowest one is used instead.
+    int lead_speed = 0, max_speed = 0;
+    int lead = -1, slowest = 0;
+    for (int i = 0; i < 4; ++i)
+    {
+        int const n = song.sfx(i);
+        if (n & 0x40)
+            continue;
 
-            int16_t sample = (int16_t)(32767.99f * volume * waveform);
+        auto const &sfx = m_ram.sfx[n];
+        int const speed = lol::max(1, (int)sfx.speed);
+        if (speed > max_speed)
+        {
+            max_speed = speed;
+            slowest = i;
+        }
+        if (!lead_speed && sfx.loop_end <= sfx.loop_start)
+        {
+            lead_speed = speed;
+            lead = i;
+        }
+    }
+
+    // A pattern with no channel enabled stops the music
+    if (!max_speed)
+        return false;
+
+    music.m_pattern = pattern;
+    music.m_speed = lead_speed ? lead_speed : max_speed;
+    music.m_lead = lead >= 0 ? lead : slowest;
+    music.m_offset = 0.f;
+
+    for (int i = 0; i < 4; ++i)
+    {
+        auto &ch = m_channels[i];
 
-            // Apply hardware effects
-            if (m_ram.hw_state.distort & (1 << chan))
+        // Leave alone channels currently used by a standalone SFX
+        if (ch.m_sfx != -1 && !ch.m_is_music)
+            continue;
+
+        int const n = song.sfx(i);
+        if (n & 0x40)
+        {
+            ch.m_sfx = -1;
+            continue;
+        }
+
+        play_sfx(i, n, 0);
+        ch.m_is_music = true;
+    }
+
+    return true;
+}
+
+void vm::stop_music()
+{
+    for (int i = 0; i < 4; ++i)
+        if (m_channels[i].m_is_music)
+        {
+            m_channels[i].m_sfx = -1;
+            m_channels[i].m_is_music = false;
+        }
+
+    m_music.m_pattern = -1;
+    m_music.m_volume_step = 0.f;
+}
+
+void vm::play_sfx(int chan, int sfx, int offset)
+{
+    auto &ch = m_channels[chan];
+
+    ch.start(sfx, offset, 0x811c9dc5 * (chan + 1));
+    ch.m_sub.m_sfx = -1;
+    ch.m_is_music = false;
+}
+
+void vm::voice::start(int sfx, int offset, uint32_t seed)
+{
+    m_sfx = sfx;
+    m_offset = (float)offset;
+    m_phase = 0;
+    m_noise.reset(seed);
+    m_note.id = -1;
+    m_can_loop = true;
+    // Playing an instrument starting with the note C-2 and the
+    // slide effect causes no noticeable pitch variation in PICO-8,
+    // so I assume this is the default value for “previous key”.
+    m_prev_key = 24;
+    // There is no default value for “previous volume”.
+    m_prev_vol = 0.f;
+}
+
+float vm::get_sample(int chan, bool half_rate)
+{
+    auto &ch = m_channels[chan];
+
+    if (ch.m_sfx == -1)
+        return 0.f;
+
+    float sample = get_sample(ch, &ch.m_sub, 1.f, half_rate);
+
+    // Music channels are affected by fading
+    return ch.m_is_music ? sample * m_music.m_volume : sample;
+}
+
+// Render one sample of a voice. Notes using a SFX instrument are played
+// by the sub-voice, if any; the sub-voice itself has none, which bounds
+// the nesting to one level. The frequency multiplier transposes the voice
+// when it is used as an instrument.
+float vm::get_sample(voice &ch, voice *sub, float freq_mult, bool half_rate)
+{
+    if (ch.m_sfx == -1)
+        return 0.f;
+
+    int const index = ch.m_sfx;
+    ASSERT(index >= 0 && index < 64);
+    struct sfx const &sfx = m_ram.sfx[index];
+
+    // Speed must be 1—255 otherwise the SFX is invalid
+    int const speed = lol::max(1, (int)sfx.speed);
+
+    float offset = ch.m_offset;
+
+    // PICO-8 exports instruments as 22050 Hz WAV files with 183 samples
+    // per speed unit per note, so this is how much we should advance
+    float const offset_per_second = 22050.f / (183.f * speed);
+    float const offset_per_sample = offset_per_second / m_sample_rate
+                                  * (half_rate ? 0.5f : 1.f);
+    float next_offset = offset + offset_per_sample;
+
+    // Handle SFX loops. From the documentation: “Looping is turned
+    // off when the start index >= end index”.
+    float const loop_range = float(sfx.loop_end - sfx.loop_start);
+    if (loop_range > 0.f && next_offset >= sfx.loop_end && ch.m_can_loop)
+    {
+        next_offset = std::fmod(next_offset - sfx.loop_start, loop_range)
+                    + sfx.loop_start;
+    }
+
+    int const note_id = (int)lol::floor(offset);
+    int const next_note_id = (int)lol::floor(next_offset);
+
+    // Compute note parameters once when entering a new note
+    auto &note = ch.m_note;
+    if (note.id != note_id)
+    {
+        auto const &n = sfx.notes[note_id];
+        note.id = note_id;
+        note.instrument = n.instrument;
+        note.fx = n.effect;
+        note.freq = key_to_freq(n.key);
+        note.volume = n.volume / 7.f;
+        note.prev_freq = key_to_freq(ch.m_prev_key);
+        note.prev_vol = ch.m_prev_vol;
+
+        // Pick the wavetable level for the highest frequency this
+        // note may reach, so that effects cannot cause aliasing.
+        float max_freq = note.freq;
+        if (note.fx == FX_SLIDE)
+            max_freq = lol::max(max_freq, note.prev_freq);
+        else if (note.fx == FX_VIBRATO)
+            max_freq *= 1.059463094359f;
+        else if (note.fx == FX_ARP_FAST || note.fx == FX_ARP_SLOW)
+        {
+            for (int k = 0; k < 4; ++k)
             {
-                sample = sample / 0x1000 * 0x1249;
+                note.arp_freq[k] = key_to_freq(sfx.notes[(note_id & ~3) | k].key);
+                max_freq = lol::max(max_freq, note.arp_freq[k]);
             }
+        }
+        note.level = synth::get_level(max_freq * freq_mult, m_sample_rate);
+
+        // SFX instruments restart with each note
+        note.sub = sub && n.custom ? sub : nullptr;
+        if (note.sub)
+            note.sub->start(n.instrument, 0, ch.m_noise.seed());
+    }
+
+    float volume = note.volume;
+
+    float sample = 0.f;
 
-            buffer[i] = sample;
+    if (volume != 0.f)
+    {
+        float freq = note.freq;
+        float const t = offset - note_id;
 
-            m_channels[chan].m_phi = phi + freq / samples_per_second;
+        // Apply effect, if any
+        switch (note.fx)
+        {
+            case FX_NO_EFFECT:
+                break;
+            case FX_SLIDE:
+                // From the documentation: “Slide to the next note and volume”,
+                // but it’s actually _from_ the _prev_ note and volume.
+                freq = lol::mix(note.prev_freq, freq, t);
+                if (note.prev_vol > 0.f)
+                    volume = lol::mix(note.prev_vol, volume, t);
+                break;
+            case FX_VIBRATO:
+            {
+                // 7.5f and 0.25f were found empirically by matching
+                // frequency graphs of PICO-8 instruments.
+                float k = lol::abs(lol::fmod(7.5f * offset / offset_per_second, 1.0f) - 0.5f) - 0.25f;
+                // Vibrato half a semi-tone, so multiply by pow(2,1/12)
+                freq = lol::mix(freq, freq * 1.059463094359f, k);
+                break;
+            }
+            case FX_DROP:
+                freq *= 1.f - t;
+                break;
+            case FX_FADE_IN:
+                volume *= t;
+                break;
+            case FX_FADE_OUT:
+                volume *= 1.f - t;
+                break;
+            case FX_ARP_FAST:
+            case FX_ARP_SLOW:
+            {
+                // From the documentation:
+                // “6 arpeggio fast  //  Iterate over groups of 4 notes at speed of 4
+                //  7 arpeggio slow  //  Iterate over groups of 4 notes at speed of 8”
+                // “If the SFX speed is <= 8, arpeggio speeds are halved to 2, 4”
+                int const m = (speed <= 8 ? 32 : 16) / (note.fx == FX_ARP_FAST ? 4 : 8);
+                int const n = (int)(m * 7.5f * offset / offset_per_second);
+                freq = note.arp_freq[n & 3];
+                break;
+            }
         }
 
-        m_channels[chan].m_offset = next_offset;
+        freq *= freq_mult;
 
-        if (next_offset >= 32.f)
+        // Play note, either using a SFX instrument transposed relative
+        // to C-2, or using a waveform
+        float waveform;
+        if (note.sub)
         {
-            m_channels[chan].m_sfx = -1;
+            waveform = get_sample(*note.sub, nullptr, freq / c2_freq, half_rate);
         }
-        else if (next_note_id != note_id)
+        else
         {
-            m_channels[chan].m_prev_key = sfx.notes[note_id].key;
-            m_channels[chan].m_prev_vol = sfx.notes[note_id].volume / 7.f;
+            uint32_t const step = synth::get_step(freq, m_sample_rate);
+            waveform = note.instrument == synth::INST_NOISE
+                     ? ch.m_noise.next(ch.m_phase, step)
+                     : synth::sample(note.instrument, note.level, ch.m_phase);
+            ch.m_phase += step;
         }
+
+        sample = volume * waveform;
     }
 
-#if DEBUG_EXPORT_WAV
-    auto fd = exports[&m_channels[chan]];
-    fwrite(buffer, samples, 1, fd);
-#endif
+    ch.m_offset = next_offset;
+
+    if (next_offset >= 32.f)
+    {
+        ch.m_sfx = -1;
+    }
+    else if (next_note_id != note_id)
+    {
+        ch.m_prev_key = sfx.notes[note_id].key;
+        ch.m_prev_vol = sfx.notes[note_id].volume / 7.f;
+    }
+
+    return sample;
 }
 
 //
 // Sound
 //
 
+// These functions run in the VM thread and must not touch the audio
+// state; commands are applied by getaudio() at the next block.
+
 void vm::api_music(int16_t pattern, int16_t fade_len, int16_t mask)
+{
+    audio_command cmd { audio_command::type::music, { pattern, fade_len, mask } };
+    if (!m_audio_commands.push(cmd))
+        msg::debug("audio command queue full, dropping music(%d)\n", pattern);
+}
+
+void vm::api_sfx(int16_t sfx, opt<int16_t> chan, int16_t offset)
+{
+    audio_command cmd { audio_command::type::sfx, { sfx, chan ? *chan : (int16_t)-1, offset } };
+    if (!m_audio_commands.push(cmd))
+        msg::debug("audio command queue full, dropping sfx(%d)\n", sfx);
+}
+
+int16_t vm::get_audio_stat(int id) const
+{
+    auto const &status = m_audio_status;
+    auto const order = std::memory_order_relaxed;
+
+    switch (id)
+    {
+        case 16: case 17: case 18: case 19: return status.sfx[id & 3].load(order);
+        case 20: case 21: case 22: case 23: return status.note[id & 3].load(order);
+        case 24: return status.pattern.load(order);
+        case 25: return status.count.load(order);
+        case 26: return status.ticks.load(order);
+    }
+
+    return 0;
+}
+
+void vm::do_music(int16_t pattern, int16_t fade_len, int16_t mask)
 {
     // pattern: 0..63, -1 to stop music.
     // fade_len: fade length in milliseconds (default 0)
@@ -249,23 +568,33 @@ void vm::api_music(int16_t pattern, int16_t fade_len, int16_t mask)
     if (pattern < -1 || pattern > 63)
         return;
 
-    if (pattern == -1 && m_music.m_pattern >= 0)
+    // Number of samples over which to fade in or out
+    float const fade_samples = fade_len * m_sample_rate / 1000.f;
+
+    if (pattern == -1)
     {
-        // Stop playing the current song
-        for (int i = 0; i < 4; ++i)
-            if (m_music.m_mask & (1 << i))
-                m_channels[i].m_sfx = -1;
-        m_music.m_pattern = -1;
+        // Stop playing the current song, possibly fading out
+        if (m_music.m_pattern >= 0)
+        {
+            if (fade_samples >= 1.f)
+                m_music.m_volume_step = -m_music.m_volume / fade_samples;
+            else
+                stop_music();
+        }
         return;
     }
 
-    m_music.m_pattern = pattern;
+    stop_music();
+
     m_music.m_mask = mask & 0xf;
+    m_music.m_count = 0;
+    m_music.m_volume = fade_samples >= 1.f ? 0.f : 1.f;
+    m_music.m_volume_step = fade_samples >= 1.f ? 1.f / fade_samples : 0.f;
 
-    private_stub(lol::format("music(%d, %d, %d)", pattern, fade_len, mask));
+    start_pattern(pattern);
 }
 
-void vm::api_sfx(int16_t sfx, opt<int16_t> in_chan, int16_t offset)
+void vm::do_sfx(int16_t sfx, int16_t chan, int16_t offset)
 {
     // SFX index: valid values are 0..63 for actual samples,
     // -1 to stop sound on a channel, -2 to stop looping on a channel
@@ -273,9 +602,7 @@ void vm::api_sfx(int16_t sfx, opt<int16_t> in_chan, int16_t offset)
     // Sound offset: valid values are 0..31, negative values act as 0,
     // and fractional values are ignored
 
-    int chan = in_chan ? *in_chan : -1;
-
-    if (sfx < -2 || sfx > 63 || chan < -1 || chan > 4 || offset > 31)
+    if (sfx < -2 || sfx > 63 || chan < -1 || chan > 3 || offset > 31)
         return;
 
     if (sfx == -1)
@@ -292,6 +619,9 @@ void vm::api_sfx(int16_t sfx, opt<int16_t> in_chan, int16_t offset)
     }
     else
     {
+        // Channels reserved for music are never picked automatically
+        int const reserved = m_music.m_pattern >= 0 ? m_music.m_mask : 0;
+
         // Find the first available channel: either a channel that plays
         // nothing, or a channel that is already playing this sample (in
         // this case PICO-8 decides to forcibly reuse that channel, which
@@ -299,8 +629,8 @@ void vm::api_sfx(int16_t sfx, opt<int16_t> in_chan, int16_t offset)
         if (chan == -1)
         {
             for (int i = 0; i < 4; ++i)
-                if (m_channels[i].m_sfx == -1 ||
-                    m_channels[i].m_sfx == sfx)
+                if (!(reserved & (1 << i)) &&
+                    (m_channels[i].m_sfx == -1 || m_channels[i].m_sfx == sfx))
                 {
                     chan = i;
                     break;
@@ -312,27 +642,22 @@ void vm::api_sfx(int16_t sfx, opt<int16_t> in_chan, int16_t offset)
         if (chan == -1)
         {
             for (int i = 0; i < 4; ++i)
-               if (chan == -1 ||
-                    m_channels[i].m_sfx < m_channels[chan].m_sfx)
+               if (!(reserved & (1 << i)) && (chan == -1 ||
+                    m_channels[i].m_sfx < m_channels[chan].m_sfx))
                    chan = i;
         }
 
+        // All channels are reserved
+        if (chan == -1)
+            return;
+
         // Stop any channel playing the same sfx
         for (int i = 0; i < 4; ++i)
             if (m_channels[i].m_sfx == sfx)
                 m_channels[i].m_sfx = -1;
 
         // Play this sound!
-        m_channels[chan].m_sfx = sfx;
-        m_channels[chan].m_offset = std::max(0.f, (float)offset);
-        m_channels[chan].m_phi = 0.f;
-        m_channels[chan].m_can_loop = true;
-        // Playing an instrument starting with the note C-2 and the
-        // slide effect causes no noticeable pitch variation in PICO-8,
-        // so I assume this is the default value for “previous key”.
-        m_channels[chan].m_prev_key = 24;
-        // There is no default value for “previous volume”.
-        m_channels[chan].m_prev_vol = 0.f;
+        play_sfx(chan, sfx, std::max(0, (int)offset));
     }
 }
 
@@ -20,6 +20,7 @@
 #include "pico8/vm.h"
 #include "bindings/lua.h"
 #include "bios.h"
+#include "synth.h"
 
 // FIXME: activate this one day, when we use Lua 5.3 maybe?
 #define HAVE_LUA_GETEXTRASPACE 0
@@ -65,6 +66,9 @@ vm::vm()
 {
     m_bios = std::make_unique<bios>();
 
+    // Build the synth tables now rather than in the audio thread
+    synth::init();
+
     m_lua = luaL_newstate();
     lua_atpanic(m_lua, &vm::panic_hook);
     luaL_openlibs(m_lua);
@@ -448,18 +452,8 @@ var<bool, int16_t, fix32, std::string, std::nullptr_t> vm::api_stat(int16_t id)
     if (id == 6)
         return std::string();
 
-    if (id >= 16 && id <= 19)
-        return m_channels[id & 3].m_sfx;
-
-    if (id >= 20 && id <= 23)
-        return m_channels[id & 3].m_sfx == -1 ? fix32(-1)
-                    : fix32((int)m_channels[id & 3].m_offset);
-
-    if (id == 24)
-        return fix32(m_music.m_pattern);
-
-    if (id == 25 || id == 26)
-        return (int16_t)0;
+    if (id >= 16 && id <= 26)
+        return fix32(get_audio_stat(id));
 
     if (id >= 30 && id <= 36)
     {
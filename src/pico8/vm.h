@@ -19,6 +19,8 @@
 
 #include "zepto8.h"
 #include "bios.h"
+#include "lockfree.h"
+#include "synth.h"
 #include "pico8/cart.h"
 #include "pico8/memory.h"
 #include "z8lua/lua.h"
@@ -53,8 +55,10 @@ public:
     virtual int get_ansi_color(uint8_t c) const;
 
     virtual void render(lol::u8vec4 *screen) const;
+    virtual void render(lol::u8vec4 *screen, frame const &f) const;
+    virtual std::tuple<uint8_t const *, size_t> get_render_state() const;
 
-    virtual std::function<void(void *, int)> get_streamer(int channel);
+    virtual std::function<void(void *, int)> get_streamer(int sample_rate);
 
     virtual void button(int index, int state);
     virtual void mouse(lol::ivec2 coords, int buttons);
@@ -63,6 +67,12 @@ public:
     virtual std::tuple<uint8_t *, size_t> ram();
     virtual std::tuple<uint8_t *, size_t> rom();
 
+    // Audio control from outside the cart, e.g. for offline rendering
+    void start_sfx(int16_t n) { api_sfx(n, 0, 0); }
+    void start_music(int16_t n) { api_music(n, 0, 0); }
+    // Same as stat(16..26), as last published by the audio thread
+    int16_t get_audio_stat(int id) const;
+
 private:
     void runtime_error(std::string str);
     static int panic_hook(struct lua_State *l);
@@ -208,7 +218,16 @@ private:
     void hline(int16_t x1, int16_t x2, int16_t y, uint32_t color_bits);
     void vline(int16_t x, int16_t y1, int16_t y2, uint32_t color_bits);
 
-    void getaudio(int channel, void *buffer, int bytes);
+    void getaudio(void *buffer, int bytes);
+    void do_music(int16_t pattern, int16_t fade_len, int16_t mask);
+    void do_sfx(int16_t sfx, int16_t chan, int16_t offset);
+    void apply_effects(int chan, hw_state const &hw, int count);
+    void update_music(uint8_t half_rate);
+    bool start_pattern(int pattern);
+    void stop_music();
+    void play_sfx(int chan, int sfx, int offset);
+    float get_sample(int chan, bool half_rate);
+    float get_sample(voice &v, voice *sub, float freq_mult, bool half_rate);
 
 public:
     // TODO: try to get rid of this
@@ -227,25 +246,88 @@ private:
     struct { fix32 x, y, b; } m_mouse;
     struct { int start = 0, stop = 0; char chars[256]; } m_keyboard;
 
-    // Audio
+    // Audio; everything below is owned by the audio thread, except for
+    // the command queue and the published status.
+    struct audio_command
+    {
+        enum class type : uint8_t { sfx, music } type;
+        int16_t args[3];
+    };
+
+    spsc_queue<audio_command, 64> m_audio_commands;
+
+    // Audio is synthesised and processed in blocks of this many samples
+    static constexpr int block_size = 256;
+    // Longest reverb delay line, enough for 192 kHz output
+    static constexpr int max_delay = 4096;
+
+    int m_sample_rate = 22050;
+    int m_reverb_delay = 366;
+    float m_lowpass_coeff = 0.5f;
+
+    // Published at the end of every audio block, for stat()
+    struct
+    {
+        std::atomic<int16_t> sfx[4] = { -1, -1, -1, -1 };
+        std::atomic<int16_t> note[4] = { -1, -1, -1, -1 };
+        std::atomic<int16_t> pattern { -1 };
+        std::atomic<int16_t> count { 0 };
+        std::atomic<int16_t> ticks { 0 };
+    }
+    m_audio_status;
+
     struct music
     {
         int m_pattern = -1;
-        uint8_t m_mask = -1;
+        uint8_t m_mask = 0;
+        int m_count = 0;     // number of patterns played
+        int m_speed = 1;     // speed of the leading channel
+        int m_lead = 0;      // the leading channel
+        float m_offset = 0;  // current note in the pattern
+        float m_volume = 1, m_volume_step = 0;
     }
     m_music;
 
-    struct channel
+    // A voice plays one SFX; channels have an extra voice for notes
+    // that use SFX instruments.
+    struct voice
     {
-        channel();
+        void start(int sfx, int offset, uint32_t seed);
 
         int16_t m_sfx = -1;
         float m_offset = 0;
-        float m_phi = 0;
+        uint32_t m_phase = 0; // 8.24 fixed point, see synth::sample()
+        synth::noise m_noise;
         bool m_can_loop = true;
 
         int8_t m_prev_key = 0;
         float m_prev_vol = 0;
+
+        // Parameters of the current note, only recomputed when the
+        // note changes; a negative id forces recomputation.
+        struct
+        {
+            int id = -1;
+            int instrument, fx, level;
+            float freq, volume;
+            float prev_freq, prev_vol;
+            float arp_freq[4];
+            voice *sub; // voice playing the SFX instrument, if any
+        }
+        m_note;
+    };
+
+    struct channel : voice
+    {
+        bool m_is_music = false;
+        voice m_sub;
+
+        // Output of the current block, and state of the hardware effects
+        float m_buffer[block_size];
+        float m_lowpass = 0.f;
+        bool m_reverb = false;
+        int m_delay_pos = 0;
+        float m_delay[max_delay];
     }
     m_channels[4];
 
@@ -74,12 +74,11 @@ player::player(bool is_embedded, bool is_raccoon)
     scene.PushCamera(m_scenecam);
     lol::Ticker::Ref(m_scenecam);
 
-    // Register audio callbacks
-    for (int i = 0; i < 4; ++i)
-    {
-        auto f = m_vm->get_streamer(i);
-        m_streams[i] = lol::audio::start_streaming(f, lol::audio::format::sint16le, 22050, 1);
-    }
+    // Register audio callback; synthesise at a typical device rate so
+    // that the backend does not need to resample.
+    int const sample_rate = 44100;
+    m_stream = lol::audio::start_streaming(m_vm->get_streamer(sample_rate),
+                                           lol::audio::format::sint16le, sample_rate, 1);
 
     // FIXME: the image gets deleted by TextureImage class, it
     // does not seem right to me.
@@ -99,13 +98,14 @@ player::player(bool is_embedded, bool is_raccoon)
 
 player::~player()
 {
+    stop_vm();
+
     lol::TileSet::destroy(m_tile);
 #if 0
     lol::TileSet::destroy(m_font_tile);
 #endif
 
-    for (int i = 0; i < 4; ++i)
-        lol::audio::stop_streaming(i);
+    lol::audio::stop_streaming(m_stream);
 
     lol::Scene& scene = lol::Scene::GetScene();
     lol::Ticker::Unref(m_scenecam);
@@ -119,7 +119,83 @@ void player::load(std::string const &name)
 
 void player::run()
 {
+    stop_vm();
     m_vm->run();
+
+    // The IDE accesses the VM directly, so only use a separate thread
+    // when running standalone.
+    if (!m_embedded)
+    {
+        m_running = true;
+        m_vm_thread = std::thread(&player::vm_loop, this);
+    }
+}
+
+void player::stop_vm()
+{
+    if (m_vm_thread.joinable())
+    {
+        m_running = false;
+        m_vm_thread.join();
+    }
+}
+
+void player::vm_loop()
+{
+    float const delta = 1.f / 60.f;
+
+    while (m_running)
+    {
+        lol::timer t;
+        step_vm(delta);
+        t.wait(delta);
+    }
+}
+
+void player::send(event const &e)
+{
+    if (!m_events.push(e))
+        msg::debug("input queue full, dropping event\n");
+}
+
+void player::step_vm(float seconds)
+{
+    // Apply pending input events. A press and release may both arrive
+    // between two steps, so every button seen down in this batch is
+    // reported for at least this step.
+    uint64_t buttons = 0;
+    for (event e; m_events.pop(e); )
+    {
+        switch (e.type)
+        {
+        case event::type::buttons:
+            m_held_buttons = e.data;
+            buttons |= e.data;
+            break;
+        case event::type::mouse:
+            m_vm->mouse(e.coords, (int)e.data);
+            break;
+        case event::type::text:
+            m_vm->text((char)e.data);
+            break;
+        }
+    }
+
+    // Buttons are only sent when they change, but the VM expects their
+    // state at every step
+    buttons |= m_held_buttons;
+    for (int i = 0; i < 64; ++i)
+        if (buttons & ((uint64_t)1 << i))
+            m_vm->button(i, 1);
+
+    m_vm->step(seconds);
+
+    // Publish the new frame, unless nothing changed on screen
+    if (!m_embedded && has_new_frame())
+    {
+        m_vm->snapshot(m_frames.back());
+        m_frames.publish();
+    }
 }
 
 void player::tick_game(float seconds)
@@ -143,40 +219,65 @@ void player::tick_game(float seconds)
     int buttons = (mouse->button(lol::input::button::BTN_Left) ? 1 : 0)
                 + (mouse->button(lol::input::button::BTN_Right) ? 2 : 0)
                 + (mouse->button(lol::input::button::BTN_Middle) ? 4 : 0);
-    m_vm->mouse(lol::ivec2(mx, my), buttons);
+    if (mx != m_sent_mouse.coords.x || my != m_sent_mouse.coords.y
+         || buttons != (int)m_sent_mouse.data)
+    {
+        m_sent_mouse.coords = lol::ivec2(mx, my);
+        m_sent_mouse.data = buttons;
+        send(m_sent_mouse);
+    }
+
+    uint64_t button_mask = 0;
+    auto set_button = [&button_mask](int index, bool state)
+    {
+        if (state)
+            button_mask |= (uint64_t)1 << index;
+    };
 
     // Joystick events
     if (auto joy = lol::input::joystick(0))
     {
-        m_vm->button(0, joy->button(lol::input::button::BTN_DpadLeft));
-        m_vm->button(1, joy->button(lol::input::button::BTN_DpadRight));
-        m_vm->button(2, joy->button(lol::input::button::BTN_DpadUp));
-        m_vm->button(3, joy->button(lol::input::button::BTN_DpadDown));
-        m_vm->button(4, joy->button(lol::input::button::BTN_A));
-        m_vm->button(5, joy->button(lol::input::button::BTN_B));
-        m_vm->button(6, joy->button(lol::input::button::BTN_Start));
+        set_button(0, joy->button(lol::input::button::BTN_DpadLeft));
+        set_button(1, joy->button(lol::input::button::BTN_DpadRight));
+        set_button(2, joy->button(lol::input::button::BTN_DpadUp));
+        set_button(3, joy->button(lol::input::button::BTN_DpadDown));
+        set_button(4, joy->button(lol::input::button::BTN_A));
+        set_button(5, joy->button(lol::input::button::BTN_B));
+        set_button(6, joy->button(lol::input::button::BTN_Start));
     }
 
     if (!m_embedded)
     {
         // Keyboard events as buttons
         for (auto const &k : m_input_map)
-            m_vm->button(k.second, keyboard->key(k.first));
+            set_button(k.second, keyboard->key(k.first));
 
         // Keyboard events as text
+        auto send_text = [this](char ch)
+        {
+            send(event { event::type::text, (uint8_t)ch, lol::ivec2(0) });
+        };
+
         if (keyboard->key_pressed(lol::input::key::SC_Return))
-            m_vm->text('\r');
+            send_text('\r');
         if (keyboard->key_pressed(lol::input::key::SC_Backspace))
-            m_vm->text('\x08');
+            send_text('\x08');
         if (keyboard->key_pressed(lol::input::key::SC_Delete))
-            m_vm->text('\x7f');
+            send_text('\x7f');
 
         for (auto ch : keyboard->text())
-            m_vm->text(ch);
+            send_text(ch);
     }
 
-    // Step the VM
-    m_vm->step(seconds);
+    if (button_mask != m_sent_buttons)
+    {
+        m_sent_buttons = button_mask;
+        send(event { event::type::buttons, button_mask, lol::ivec2(0) });
+    }
+
+    // Step the VM, unless it runs on its own thread
+    if (!m_vm_thread.joinable())
+        step_vm(seconds);
 }
 
 void player::tick_draw(float seconds, lol::Scene &scene)
@@ -201,19 +302,42 @@ void player::tick_draw(float seconds, lol::Scene &scene)
 
     if (!m_embedded)
     {
-        // Render the VM screen to our buffer
-        m_vm->render(m_screen.data());
+        // The VM only publishes frames that changed; idle carts often leave
+        // the screen untouched for hundreds of frames.
+        if (m_frames.fetch())
+        {
+            // Render the latest VM frame to our buffer
+            m_vm->render(m_screen.data(), m_frames.front());
 
-        // Blit buffer to the texture
-        // FIXME: move this to some kind of memory viewer class?
-        m_tile->GetTexture()->Bind();
-        m_tile->GetTexture()->SetData(m_screen.data());
+            // Blit buffer to the texture
+            // FIXME: move this to some kind of memory viewer class?
+            m_tile->GetTexture()->Bind();
+            m_tile->GetTexture()->SetData(m_screen.data());
+        }
 
         scene.get_renderer()->clear_color(lol::Color::black);
         scene.AddTile(m_tile, 0, lol::vec3((float)m_screen_pos.x, (float)m_screen_pos.y, 10.f), lol::vec2(m_scale), 0.f);
     }
 }
 
+bool player::has_new_frame()
+{
+    auto const &screen = m_vm->get_screen().data;
+    auto [state, state_size] = m_vm->get_render_state();
+    size_t const size = sizeof(screen) + state_size;
+
+    // Compare the screen and the render state with the last frame
+    if (m_last_frame.size() == size
+         && !memcmp(m_last_frame.data(), screen, sizeof(screen))
+         && !memcmp(m_last_frame.data() + sizeof(screen), state, state_size))
+        return false;
+
+    m_last_frame.resize(size);
+    memcpy(m_last_frame.data(), screen, sizeof(screen));
+    memcpy(m_last_frame.data() + sizeof(screen), state, state_size);
+    return true;
+}
+
 lol::Texture *player::get_texture()
 {
     return m_tile ? m_tile->GetTexture() : nullptr;
@@ -14,12 +14,19 @@
 
 #include <lol/engine.h>
 
+#include <atomic>
+#include <thread>
+
 #include "zepto8.h"
+#include "lockfree.h"
 #include "pico8/cart.h"
 
 // The player class
 // ————————————————
 // This is a high-level Lol Engine entity that runs the ZEPTO-8 VM.
+// Unless embedded, the VM runs on its own thread at a fixed 60 Hz rate;
+// frames are passed to the render thread through a triple buffer and
+// input is passed to the VM thread through a lock-free queue.
 
 namespace z8
 {
@@ -48,9 +55,37 @@ public:
     lol::Texture *get_font_texture();
 
 private:
+    // Input events sent to the VM
+    struct event
+    {
+        enum class type : uint8_t { buttons, mouse, text } type;
+        uint64_t data;      // button mask, mouse buttons or character
+        lol::ivec2 coords;  // mouse coordinates
+    };
+
+    void send(event const &e);
+    void step_vm(float seconds);
+    void vm_loop();
+    void stop_vm();
+    bool has_new_frame();
+
     std::shared_ptr<vm_base> m_vm;
 
+    // VM thread
+    std::thread m_vm_thread;
+    std::atomic<bool> m_running { false };
+
+    // Input (game thread side, then VM side)
     std::map<lol::input::key, int> m_input_map;
+    spsc_queue<event, 256> m_events;
+    uint64_t m_sent_buttons = 0;
+    event m_sent_mouse = { event::type::mouse, 0, lol::ivec2(-1) };
+    uint64_t m_held_buttons = 0;
+
+    // Frames published by the VM, and the copy of the screen and render
+    // state of the last published one
+    triple_buffer<frame> m_frames;
+    std::vector<uint8_t> m_last_frame;
     array<u8vec4> m_screen;
 
     // Video
@@ -60,7 +95,7 @@ private:
     float m_scale;
 
     // Audio
-    int m_streams[4];
+    int m_stream;
 
     lol::Camera *m_scenecam;
     lol::TileSet *m_tile;
@@ -203,18 +203,19 @@ void vm::text(char ch)
 {
 }
 
-void vm::render(lol::u8vec4 *screen) const
+static void render_screen(lol::u8vec4 *screen, u4mat2<128, 128> const &src,
+                          lol::u8vec3 const *palette)
 {
     /* Precompute the current palette for pairs of pixels */
     struct { u8vec4 a, b; } lut[256];
     for (int n = 0; n < 256; ++n)
     {
-        lut[n].a = u8vec4(m_ram.palette[n % 16], 0xff);
-        lut[n].b = u8vec4(m_ram.palette[n / 16], 0xff);
+        lut[n].a = u8vec4(palette[n % 16], 0xff);
+        lut[n].b = u8vec4(palette[n / 16], 0xff);
     }
 
     /* Render actual screen */
-    for (auto &line : m_ram.screen.data)
+    for (auto &line : src.data)
     for (uint8_t p : line)
     {
         *screen++ = lut[p].a;
@@ -222,6 +223,22 @@ void vm::render(lol::u8vec4 *screen) const
     }
 }
 
+void vm::render(lol::u8vec4 *screen) const
+{
+    render_screen(screen, m_ram.screen, m_ram.palette);
+}
+
+void vm::render(lol::u8vec4 *screen, frame const &f) const
+{
+    // The render state is the palette, see get_render_state()
+    render_screen(screen, f.screen, (lol::u8vec3 const *)f.state);
+}
+
+std::tuple<uint8_t const *, size_t> vm::get_render_state() const
+{
+    return std::make_tuple((uint8_t const *)&m_ram.palette, sizeof(m_ram.palette));
+}
+
 int vm::get_ansi_color(uint8_t c) const
 {
     // FIXME: this is the PICO-8 palette for now
@@ -258,7 +275,7 @@ u4mat2<128, 128> const &vm::get_screen() const
     return m_ram.screen;
 }
 
-std::function<void(void *, int)> vm::get_streamer(int channel)
+std::function<void(void *, int)> vm::get_streamer(int sample_rate)
 {
     return [](void *, int) {};
 }
@@ -36,12 +36,14 @@ public:
     virtual bool step(float seconds);
 
     virtual void render(lol::u8vec4 *screen) const;
+    virtual void render(lol::u8vec4 *screen, frame const &f) const;
+    virtual std::tuple<uint8_t const *, size_t> get_render_state() const;
 
     virtual std::string const &get_code() const;
     virtual u4mat2<128, 128> const &get_screen() const;
     virtual int get_ansi_color(uint8_t c) const;
 
-    virtual std::function<void(void *, int)> get_streamer(int channel);
+    virtual std::function<void(void *, int)> get_streamer(int sample_rate);
 
     virtual void button(int index, int state);
     virtual void mouse(lol::ivec2 coords, int buttons);
@@ -0,0 +1,763 @@
+//
+//  ZEPTO-8 — Fantasy console emulator
+//
+//  Copyright © 2016—2020 Sam Hocevar <sam@hocevar.net>
+//
+//  This program is free software. It comes without any warranty, to
+//  the extent permitted by applicable law. You can redistribute it
+//  and/or modify it under the terms of the Do What the Fuck You Want
+//  to Public License, Version 2, as published by the WTFPL Task Force.
+//  See http://www.wtfpl.net/ for more details.
+//
+
+#if HAVE_CONFIG_H
+#   include "config.h"
+#endif
+
+#include <lol/engine.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <functional>
+#include <limits>
+#include <thread>
+#include <tuple>
+
+#include "squeeze.h"
+#include "bits.h"
+
+// The GZ8 deflate dialect
+// ———————————————————————
+// This is what our zlib emits when built with GZ8, and what unz8 reads:
+//  - block headers are 2 bits: 0 1 for stored, 1 0 for static, 1 1 for
+//    dynamic; 0 0 ends the stream
+//  - stored blocks have a 16-bit length, but no alignment and no
+//    complemented length
+//  - code length code lengths are sent in natural order after 16, 17, 18
+// Everything else is plain deflate.
+
+namespace z8
+{
+
+static int const min_match = 3;
+static int const max_match = 258;
+static int const max_distance = 32768;
+static int const max_chain = 8192;
+
+static uint8_t const cl_order[19] =
+    { 16, 17, 18, 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15 };
+
+static uint16_t const length_base[29] =
+    { 3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+      35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258 };
+static uint8_t const length_extra[29] =
+    { 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+      3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0 };
+static uint16_t const dist_base[30] =
+    { 1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+      257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145,
+      8193, 12289, 16385, 24577 };
+static uint8_t const dist_extra[30] =
+    { 0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+      7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13 };
+static uint8_t const cl_extra[19] =
+    { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 2, 3, 7 };
+
+// Length code (minus 257) for a match length
+static int length_code(int len)
+{
+    static uint8_t const *lut = []()
+    {
+        static uint8_t t[max_match + 1];
+        for (int c = 0; c < 29; ++c)
+            for (int l = length_base[c]; l < length_base[c] + (1 << length_extra[c])
+                                          && l <= max_match; ++l)
+                t[l] = uint8_t(c);
+        return t;
+    }();
+    return lut[len];
+}
+
+// Distance code for a match distance, using the same trick as zlib: the
+// codes for distances above 256 only depend on the upper bits.
+static int dist_code(int dist)
+{
+    static uint8_t const *lut = []()
+    {
+        static uint8_t t[512];
+        for (int c = 0; c < 30; ++c)
+            for (int d = dist_base[c]; d < dist_base[c] + (1 << dist_extra[c]); ++d)
+                t[d <= 256 ? d - 1 : 256 + ((d - 1) >> 7)] = uint8_t(c);
+        return t;
+    }();
+    return dist <= 256 ? lut[dist - 1] : lut[256 + ((dist - 1) >> 7)];
+}
+
+// A literal (dist == 0) or a back reference (value is the length)
+struct lz_symbol
+{
+    uint16_t value, dist;
+};
+
+// Symbol counts for a block, not including the end-of-block marker
+struct histogram
+{
+    histogram() = default;
+
+    histogram(lz_symbol const *syms, size_t count)
+    {
+        for (size_t i = 0; i < count; ++i)
+            add(syms[i]);
+    }
+
+    void add(lz_symbol s, int k = 1)
+    {
+        if (s.dist)
+        {
+            lit[257 + length_code(s.value)] += k;
+            dist[dist_code(s.dist)] += k;
+            bytes += k * s.value;
+        }
+        else
+        {
+            lit[s.value] += k;
+            bytes += k;
+        }
+    }
+
+    int32_t lit[288] = {}, dist[30] = {};
+    int64_t bytes = 0;
+};
+
+// Build length-limited Huffman code lengths. Codes that are too long are
+// fixed with the same heuristic as miniz, which is not optimal but almost
+// never triggers with our small inputs.
+static void huffman_lengths(int32_t const *freq, int count, int max_bits,
+                            uint8_t *lengths)
+{
+    std::fill(lengths, lengths + count, 0);
+
+    int syms[288], m = 0;
+    for (int i = 0; i < count; ++i)
+        if (freq[i] > 0)
+            syms[m++] = i;
+
+    // Deflate decoders expect complete codes, so never use a single symbol
+    if (m < 2)
+    {
+        if (m == 1)
+            lengths[syms[0]] = lengths[syms[0] ? 0 : 1] = 1;
+        return;
+    }
+
+    std::sort(syms, syms + m, [&](int a, int b)
+    {
+        return freq[a] < freq[b] || (freq[a] == freq[b] && a < b);
+    });
+
+    // Two-queue Huffman construction: leaves are already sorted, and
+    // internal nodes are created in increasing weight order.
+    int64_t weight[2 * 288];
+    int parent[2 * 288], depth[2 * 288];
+    for (int i = 0; i < m; ++i)
+        weight[i] = freq[syms[i]];
+
+    int leaf = 0, node = m;
+    for (int next = m; next < 2 * m - 1; ++next)
+    {
+        auto pick = [&]()
+        {
+            if (leaf < m && (node >= next || weight[leaf] <= weight[node]))
+                return leaf++;
+            return node++;
+        };
+        int a = pick(), b = pick();
+        weight[next] = weight[a] + weight[b];
+        parent[a] = parent[b] = next;
+    }
+
+    depth[2 * m - 2] = 0;
+    for (int i = 2 * m - 3; i >= 0; --i)
+        depth[i] = depth[parent[i]] + 1;
+
+    int bl_count[32] = {};
+    for (int i = 0; i < m; ++i)
+        ++bl_count[std::min(depth[i], max_bits)];
+
+    uint32_t total = 0;
+    for (int l = 1; l <= max_bits; ++l)
+        total += uint32_t(bl_count[l]) << (max_bits - l);
+    for (; total > 1u << max_bits; --total)
+    {
+        --bl_count[max_bits];
+        for (int l = max_bits - 1; l > 0; --l)
+            if (bl_count[l])
+            {
+                --bl_count[l];
+                bl_count[l + 1] += 2;
+                break;
+            }
+    }
+
+    // Rarest symbols get the longest codes
+    for (int l = max_bits, i = 0; l > 0; --l)
+        for (int k = 0; k < bl_count[l]; ++k)
+            lengths[syms[i++]] = uint8_t(l);
+}
+
+// Canonical Huffman codes, bit-reversed for our LSB-first writer
+static void huffman_codes(uint8_t const *lengths, int count, uint16_t *codes)
+{
+    int bl_count[16] = {}, next_code[16] = {};
+    for (int i = 0; i < count; ++i)
+        ++bl_count[lengths[i]];
+    bl_count[0] = 0;
+
+    for (int l = 1, code = 0; l < 16; ++l)
+        next_code[l] = code = (code + bl_count[l - 1]) << 1;
+
+    for (int i = 0; i < count; ++i)
+    {
+        int code = lengths[i] ? next_code[lengths[i]]++ : 0, rev = 0;
+        for (int k = 0; k < lengths[i]; ++k)
+            rev |= (code >> k & 1) << (lengths[i] - 1 - k);
+        codes[i] = uint16_t(rev);
+    }
+}
+
+static uint8_t const *fixed_lit_lengths()
+{
+    static uint8_t const *lut = []()
+    {
+        static uint8_t t[288];
+        for (int i = 0; i < 288; ++i)
+            t[i] = i < 144 ? 8 : i < 256 ? 9 : i < 280 ? 7 : 8;
+        return t;
+    }();
+    return lut;
+}
+
+static uint8_t const fixed_dist_lengths[30] =
+    { 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5,
+      5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5 };
+
+// Huffman trees for a dynamic block, and their run-length encoded
+// description. Runs never cross from the literal to the distance code
+// lengths, because unz8 reads them as two separate tables.
+struct dynamic_trees
+{
+    dynamic_trees(histogram const &h)
+    {
+        int32_t lit[288];
+        std::copy(h.lit, h.lit + 288, lit);
+        lit[256] = 1;
+
+        huffman_lengths(lit, 286, 15, lit_len);
+        lit_len[286] = lit_len[287] = 0;
+        huffman_lengths(h.dist, 30, 15, dist_len);
+
+        for (hlit = 286; hlit > 257 && !lit_len[hlit - 1]; --hlit)
+            ;
+        for (hdist = 30; hdist > 1 && !dist_len[hdist - 1]; --hdist)
+            ;
+
+        encode_lengths(lit_len, hlit);
+        encode_lengths(dist_len, hdist);
+
+        int32_t cl_freq[19] = {};
+        for (auto t : rle)
+            ++cl_freq[t & 31];
+        huffman_lengths(cl_freq, 19, 7, cl_len);
+
+        for (hclen = 19; hclen > 4 && !cl_len[cl_order[hclen - 1]]; --hclen)
+            ;
+
+        header_bits = 5 + 5 + 4 + 3 * hclen;
+        for (auto t : rle)
+            header_bits += cl_len[t & 31] + cl_extra[t & 31];
+    }
+
+    // Code length symbols, with the extra bits value in the upper bits
+    void encode_lengths(uint8_t const *lengths, int count)
+    {
+        for (int i = 0; i < count; )
+        {
+            int const val = lengths[i];
+            int run = 1;
+            while (i + run < count && lengths[i + run] == val)
+                ++run;
+            i += run;
+
+            if (val == 0)
+            {
+                for (int k; run >= 11; run -= k)
+                    rle.push_back(uint16_t(18 | ((k = std::min(run, 138)) - 11) << 5));
+                if (run >= 3)
+                    rle.push_back(uint16_t(17 | (run - 3) << 5)), run = 0;
+            }
+            else
+            {
+                rle.push_back(uint16_t(val)), --run;
+                for (int k; run >= 3; run -= k)
+                    rle.push_back(uint16_t(16 | ((k = std::min(run, 6)) - 3) << 5));
+            }
+
+            while (run--)
+                rle.push_back(uint16_t(val));
+        }
+    }
+
+    uint8_t lit_len[288], dist_len[30], cl_len[19];
+    int hlit, hdist, hclen, header_bits;
+    std::vector<uint16_t> rle;
+};
+
+// Size of the compressed symbols, including the end-of-block marker
+static int64_t data_bits(histogram const &h, uint8_t const *lit_len,
+                         uint8_t const *dist_len)
+{
+    int64_t bits = lit_len[256];
+    for (int i = 0; i < 256; ++i)
+        bits += int64_t(h.lit[i]) * lit_len[i];
+    for (int i = 0; i < 29; ++i)
+        bits += int64_t(h.lit[257 + i]) * (lit_len[257 + i] + length_extra[i]);
+    for (int i = 0; i < 30; ++i)
+        bits += int64_t(h.dist[i]) * (dist_len[i] + dist_extra[i]);
+    return bits;
+}
+
+enum class block_type { stored, fixed, dynamic };
+
+// Exact size in bits of the best encoding for a block
+static int64_t block_bits(histogram const &h, block_type *type = nullptr)
+{
+    dynamic_trees trees(h);
+    int64_t const dynamic = 2 + trees.header_bits
+                          + data_bits(h, trees.lit_len, trees.dist_len);
+    int64_t const fixed = 2 + data_bits(h, fixed_lit_lengths(), fixed_dist_lengths);
+    int64_t const stored = h.bytes <= 0xffff ? 2 + 16 + 8 * h.bytes
+                                             : std::numeric_limits<int64_t>::max();
+
+    int64_t const best = std::min(dynamic, std::min(fixed, stored));
+    if (type)
+        *type = best == stored ? block_type::stored
+              : best == fixed ? block_type::fixed : block_type::dynamic;
+    return best;
+}
+
+// Run job(0) … job(count - 1) on all available cores
+static void parallel_for(size_t count, std::function<void(size_t)> const &job)
+{
+    std::atomic<size_t> next(0);
+
+    auto worker = [&]()
+    {
+        for (size_t i; (i = next++) < count; )
+            job(i);
+    };
+
+    std::vector<std::thread> threads;
+    int const nthreads = lol::max(1, (int)std::thread::hardware_concurrency());
+    for (int i = 0; i < nthreads; ++i)
+        threads.push_back(std::thread(worker));
+    for (auto &t : threads)
+        t.join();
+}
+
+// All useful back references at each position: for every length, only
+// the closest match of at least that length is kept, so the matches at
+// a given position have increasing lengths and distances.
+struct match_finder
+{
+    match_finder(uint8_t const *data, int size)
+      : first(size + 1)
+    {
+        int const hash_bits = 15;
+        std::vector<int> head(1 << hash_bits, -1), chain(size, -1);
+
+        for (int i = 0; i < size; ++i)
+        {
+            first[i] = uint32_t(matches.size());
+            if (i + min_match > size)
+                continue;
+
+            uint32_t h = (data[i] << 16 | data[i + 1] << 8 | data[i + 2])
+                           * 0x9e3779b1u >> (32 - hash_bits);
+            int const limit = std::min(max_match, size - i);
+            int best = min_match - 1, depth = max_chain;
+
+            for (int j = head[h]; j >= 0 && i - j <= max_distance && depth--; j = chain[j])
+            {
+                if (data[j + best] != data[i + best])
+                    continue;
+                int k = 0;
+                while (k < limit && data[j + k] == data[i + k])
+                    ++k;
+                if (k > best)
+                {
+                    best = k;
+                    matches.push_back(lz_symbol{ uint16_t(k), uint16_t(i - j) });
+                    if (k == limit)
+                        break;
+                }
+            }
+
+            chain[i] = head[h];
+            head[h] = i;
+        }
+
+        first[size] = uint32_t(matches.size());
+    }
+
+    std::vector<uint32_t> first;
+    std::vector<lz_symbol> matches;
+};
+
+// Symbol costs in bits, used to find the cheapest parse
+struct cost_model
+{
+    // Costs of a static block
+    cost_model()
+    {
+        for (int i = 0; i < 288; ++i)
+            lit[i] = fixed_lit_lengths()[i];
+        for (int i = 0; i < 30; ++i)
+            dist[i] = fixed_dist_lengths[i];
+        update();
+    }
+
+    // Costs estimated from the entropy of a previous parse
+    cost_model(histogram const &h)
+    {
+        int32_t freq[288];
+        std::copy(h.lit, h.lit + 288, freq);
+        freq[256] = 1;
+        entropy(freq, 288, lit);
+        entropy(h.dist, 30, dist);
+        update();
+    }
+
+    static void entropy(int32_t const *freq, int count, float *cost)
+    {
+        int64_t sum = 0;
+        for (int i = 0; i < count; ++i)
+            sum += freq[i];
+        float const log_sum = std::log2(float(std::max(sum, int64_t(1))));
+        for (int i = 0; i < count; ++i)
+            cost[i] = freq[i] ? log_sum - std::log2(float(freq[i])) : log_sum + 1.f;
+    }
+
+    void update()
+    {
+        for (int l = min_match; l <= max_match; ++l)
+        {
+            int const c = length_code(l);
+            length[l] = lit[257 + c] + length_extra[c];
+        }
+    }
+
+    float match_cost(int dist_) const
+    {
+        int const c = dist_code(dist_);
+        return dist[c] + dist_extra[c];
+    }
+
+    float lit[288], dist[30], length[max_match + 1];
+};
+
+// The cheapest parse of data[start, end) for a given cost model
+static std::vector<lz_symbol> parse(uint8_t const *data, int start, int end,
+                                    match_finder const &mf, cost_model const &model)
+{
+    int const n = end - start;
+    std::vector<float> cost(n + 1, std::numeric_limits<float>::infinity());
+    std::vector<lz_symbol> from(n + 1);
+    cost[0] = 0.f;
+
+    for (int i = 0; i < n; ++i)
+    {
+        int const pos = start + i;
+        float const c = cost[i];
+
+        float const lit = c + model.lit[data[pos]];
+        if (lit < cost[i + 1])
+        {
+            cost[i + 1] = lit;
+            from[i + 1] = lz_symbol{ data[pos], 0 };
+        }
+
+        int len = min_match;
+        for (uint32_t m = mf.first[pos]; m < mf.first[pos + 1]; ++m)
+        {
+            lz_symbol const &match = mf.matches[m];
+            float const base = c + model.match_cost(match.dist);
+            int const top = std::min(int(match.value), n - i);
+            for (; len <= top; ++len)
+            {
+                float const t = base + model.length[len];
+                if (t < cost[i + len])
+                {
+                    cost[i + len] = t;
+                    from[i + len] = lz_symbol{ uint16_t(len), match.dist };
+                }
+            }
+            if (top < match.value)
+                break;
+        }
+    }
+
+    std::vector<lz_symbol> ret;
+    for (int i = n; i > 0; i -= from[i].dist ? from[i].value : 1)
+        ret.push_back(from[i]);
+    std::reverse(ret.begin(), ret.end());
+    return ret;
+}
+
+// Iterative optimal parsing: the first parse is optimal for a static
+// block, and the statistics of each parse give the costs for the next.
+static std::vector<lz_symbol> optimize(uint8_t const *data, int start, int end,
+                                       match_finder const &mf, int iterations)
+{
+    std::vector<lz_symbol> best;
+    int64_t best_bits = std::numeric_limits<int64_t>::max(), last_bits = 0;
+    cost_model model;
+
+    for (int i = 0; i < iterations; ++i)
+    {
+        auto syms = parse(data, start, end, mf, model);
+        histogram h(syms.data(), syms.size());
+        int64_t const bits = block_bits(h);
+        if (bits < best_bits)
+        {
+            best_bits = bits;
+            best = syms;
+        }
+        else if (bits == last_bits)
+            break; // converged
+        last_bits = bits;
+        model = cost_model(h);
+    }
+
+    return best;
+}
+
+// Find the split point in syms[a, b) that minimises the total size of
+// both halves. Candidates are evaluated in parallel, first on a coarse
+// grid, then refined around the best one. Returns b if splitting does
+// not help.
+static size_t find_split(std::vector<lz_symbol> const &syms, size_t a, size_t b)
+{
+    size_t const max_candidates = 4096, chunk_size = 64;
+
+    histogram const total(syms.data() + a, b - a);
+    int64_t best_bits = block_bits(total);
+    size_t best = b;
+
+    for (size_t lo = a + 1, hi = b - 1; lo <= hi && hi < b; )
+    {
+        size_t const step = (hi - lo) / max_candidates + 1;
+        size_t const count = (hi - lo) / step + 1;
+        size_t const chunks = (count + chunk_size - 1) / chunk_size;
+        std::vector<std::pair<int64_t, size_t>> results(chunks);
+
+        parallel_for(chunks, [&](size_t chunk)
+        {
+            size_t p = lo + chunk * chunk_size * step;
+            histogram left(syms.data() + a, p - a), right = total;
+            for (int i = 0; i < 288; ++i)
+                right.lit[i] -= left.lit[i];
+            for (int i = 0; i < 30; ++i)
+                right.dist[i] -= left.dist[i];
+            right.bytes -= left.bytes;
+
+            results[chunk] = { std::numeric_limits<int64_t>::max(), b };
+            for (size_t k = 0; k < chunk_size && p <= hi; ++k)
+            {
+                int64_t const bits = block_bits(left) + block_bits(right);
+                if (bits < results[chunk].first)
+                    results[chunk] = { bits, p };
+                for (size_t q = p; q < p + step && q < b; ++q)
+                {
+                    left.add(syms[q]);
+                    right.add(syms[q], -1);
+                }
+                p += step;
+            }
+        });
+
+        for (auto const &r : results)
+            if (r.first < best_bits)
+                std::tie(best_bits, best) = r;
+
+        if (step == 1 || best == b)
+            break;
+        lo = std::max(a + 1, best - std::min(best, step));
+        hi = std::min(b - 1, best + step);
+    }
+
+    return best;
+}
+
+// Split the symbol stream recursively, returning the block boundaries
+// as byte positions
+static std::vector<int> split_blocks(std::vector<lz_symbol> const &syms)
+{
+    std::vector<size_t> splits;
+    std::vector<std::pair<size_t, size_t>> todo = { { 0, syms.size() } };
+
+    while (todo.size())
+    {
+        auto [a, b] = todo.back();
+        todo.pop_back();
+        if (b - a < 2)
+            continue;
+        size_t const p = find_split(syms, a, b);
+        if (p < b)
+        {
+            splits.push_back(p);
+            todo.push_back({ a, p });
+            todo.push_back({ p, b });
+        }
+    }
+
+    std::sort(splits.begin(), splits.end());
+
+    std::vector<int> ret = { 0 };
+    int pos = 0;
+    for (size_t i = 0, s = 0; i < syms.size(); ++i)
+    {
+        if (s < splits.size() && splits[s] == i)
+            ret.push_back(pos), ++s;
+        pos += syms[i].dist ? syms[i].value : 1;
+    }
+    ret.push_back(pos);
+    return ret;
+}
+
+struct block
+{
+    int start, end;
+    std::vector<lz_symbol> syms;
+};
+
+static void write_block(bit_writer &bw, uint8_t const *data, block const &b)
+{
+    histogram h(b.syms.data(), b.syms.size());
+    block_type type;
+    block_bits(h, &type);
+
+    if (type == block_type::stored)
+    {
+        bw.put(0x2, 2);
+        bw.put(b.end - b.start, 16);
+        for (int i = b.start; i < b.end; ++i)
+            bw.put(data[i], 8);
+        return;
+    }
+
+    uint8_t const *lit_len = fixed_lit_lengths(), *dist_len = fixed_dist_lengths;
+    dynamic_trees trees(h);
+
+    if (type == block_type::fixed)
+    {
+        bw.put(0x1, 2);
+    }
+    else
+    {
+        bw.put(0x3, 2);
+        bw.put(trees.hlit - 257, 5);
+        bw.put(trees.hdist - 1, 5);
+        bw.put(trees.hclen - 4, 4);
+        for (int i = 0; i < trees.hclen; ++i)
+            bw.put(trees.cl_len[cl_order[i]], 3);
+
+        uint16_t cl_codes[19];
+        huffman_codes(trees.cl_len, 19, cl_codes);
+        for (auto t : trees.rle)
+        {
+            bw.put(cl_codes[t & 31], trees.cl_len[t & 31]);
+            bw.put(t >> 5, cl_extra[t & 31]);
+        }
+
+        lit_len = trees.lit_len;
+        dist_len = trees.dist_len;
+    }
+
+    uint16_t lit_codes[288], dist_codes[30];
+    huffman_codes(lit_len, 288, lit_codes);
+    huffman_codes(dist_len, 30, dist_codes);
+
+    for (auto s : b.syms)
+    {
+        if (!s.dist)
+        {
+            bw.put(lit_codes[s.value], lit_len[s.value]);
+            continue;
+        }
+
+        int const lc = length_code(s.value), dc = dist_code(s.dist);
+        bw.put(lit_codes[257 + lc], lit_len[257 + lc]);
+        bw.put(s.value - length_base[lc], length_extra[lc]);
+        bw.put(dist_codes[dc], dist_len[dc]);
+        bw.put(s.dist - dist_base[dc], dist_extra[dc]);
+    }
+
+    bw.put(lit_codes[256], lit_len[256]);
+}
+
+static int64_t total_bits(std::vector<block> const &blocks)
+{
+    int64_t bits = 2;
+    for (auto const &b : blocks)
+        bits += block_bits(histogram(b.syms.data(), b.syms.size()));
+    return bits;
+}
+
+std::vector<uint8_t> squeeze(std::vector<uint8_t> const &input, int iterations)
+{
+    uint8_t const *data = input.data();
+    int const size = int(input.size());
+    match_finder const mf(data, size);
+
+    // Start with a single block, then alternate between splitting the
+    // current parse and parsing each new block again, until it no
+    // longer helps.
+    std::vector<block> best = { { 0, size, optimize(data, 0, size, mf, iterations) } };
+    int64_t best_bits = total_bits(best);
+
+    for (;;)
+    {
+        std::vector<lz_symbol> syms;
+        for (auto const &b : best)
+            syms.insert(syms.end(), b.syms.begin(), b.syms.end());
+
+        auto const bounds = split_blocks(syms);
+        std::vector<block> blocks(bounds.size() - 1);
+        parallel_for(blocks.size(), [&](size_t i)
+        {
+            blocks[i].start = bounds[i];
+            blocks[i].end = bounds[i + 1];
+            blocks[i].syms = optimize(data, bounds[i], bounds[i + 1], mf, iterations);
+        });
+
+        int64_t const bits = total_bits(blocks);
+        if (bits >= best_bits)
+            break;
+        best = std::move(blocks);
+        best_bits = bits;
+    }
+
+    std::vector<uint8_t> ret;
+    bit_writer bw(ret);
+    for (auto const &b : best)
+        if (b.end > b.start)
+            write_block(bw, data, b);
+    bw.put(0x0, 2);
+    bw.flush();
+
+    return ret;
+}
+
+} // namespace z8
+
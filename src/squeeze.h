@@ -0,0 +1,28 @@
+//
+//  ZEPTO-8 — Fantasy console emulator
+//
+//  Copyright © 2016—2020 Sam Hocevar <sam@hocevar.net>
+//
+//  This program is free software. It comes without any warranty, to
+//  the extent permitted by applicable law. You can redistribute it
+//  and/or modify it under the terms of the Do What the Fuck You Want
+//  to Public License, Version 2, as published by the WTFPL Task Force.
+//  See http://www.wtfpl.net/ for more details.
+//
+
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+namespace z8
+{
+
+// Exhaustive version of compress(): iterative optimal parsing and a
+// multithreaded block split search. The output is the same deflate
+// dialect as zlib’s GZ8 build, so unz8 can decompress it, but finding
+// it is orders of magnitude slower.
+std::vector<uint8_t> squeeze(std::vector<uint8_t> const &input, int iterations = 15);
+
+} // namespace z8
+
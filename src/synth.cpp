@@ -14,11 +14,138 @@
 #   include "config.h"
 #endif
 
+#include <cmath>
+#include <vector>
+
 #include "synth.h"
 
 namespace z8
 {
 
+// Wavetables have one period of 1024 samples, and there is one table per
+// power of two of the number of harmonics, from 1 to 256.
+static int const table_bits = 10;
+static int const table_size = 1 << table_bits;
+static int const max_level = 8;
+
+struct wavetables
+{
+    wavetables();
+
+    // One extra sample at the end of each table avoids wrapping
+    // when interpolating.
+    float periodic[synth::INST_ORGAN + 1][max_level + 1][table_size + 1];
+};
+
+wavetables::wavetables()
+{
+    // Sample reference waveforms at a high rate, then compute their
+    // Fourier series and resynthesise them with a limited number of
+    // harmonics for each level.
+    int const m = 4 * table_size;
+    std::vector<float> cos_lut(m), sin_lut(m), ref(m);
+    for (int i = 0; i < m; ++i)
+    {
+        cos_lut[i] = (float)std::cos(2.0 * lol::D_PI * i / m);
+        sin_lut[i] = (float)std::sin(2.0 * lol::D_PI * i / m);
+    }
+
+    int const harmonics = 1 << max_level;
+
+    for (int inst = 0; inst <= synth::INST_ORGAN; ++inst)
+    {
+        double dc = 0.0;
+        for (int i = 0; i < m; ++i)
+            dc += ref[i] = synth::waveform(inst, (float)i / m);
+        dc /= m;
+
+        float a[harmonics + 1], b[harmonics + 1];
+        for (int h = 1; h <= harmonics; ++h)
+        {
+            double sum_a = 0.0, sum_b = 0.0;
+            for (int i = 0, k = 0; i < m; ++i, k = (k + h) % m)
+            {
+                sum_a += ref[i] * cos_lut[k];
+                sum_b += ref[i] * sin_lut[k];
+            }
+            a[h] = (float)(2.0 * sum_a / m);
+            b[h] = (float)(2.0 * sum_b / m);
+        }
+
+        for (int level = 0; level <= max_level; ++level)
+        {
+            float *table = periodic[inst][level];
+            for (int i = 0; i < table_size; ++i)
+            {
+                float x = (float)dc;
+                for (int h = 1; h <= 1 << level; ++h)
+                {
+                    int k = h * i * (m / table_size) % m;
+                    x += a[h] * cos_lut[k] + b[h] * sin_lut[k];
+                }
+                table[i] = x;
+            }
+            table[table_size] = table[0];
+        }
+    }
+}
+
+static wavetables const &get_tables()
+{
+    static wavetables const tables;
+    return tables;
+}
+
+void synth::init()
+{
+    get_tables();
+}
+
+int synth::get_level(float freq, float samples_per_second)
+{
+    // Use as many harmonics as possible below the Nyquist frequency
+    float const max_harmonics = 0.5f * samples_per_second / lol::max(freq, 1.f);
+    return lol::clamp(std::ilogb(max_harmonics), 0, max_level);
+}
+
+float synth::sample(int instrument, int level, uint32_t phase)
+{
+    auto const &tables = get_tables();
+
+    auto lerp = [](float const *table, uint32_t index, uint32_t frac, int bits)
+    {
+        float t = frac * (1.f / (1 << bits));
+        return table[index] + t * (table[index + 1] - table[index]);
+    };
+
+    switch (instrument)
+    {
+        case INST_NOISE:
+            // Noise has state, and is generated by synth::noise instead
+            return 0.f;
+        case INST_PHASER:
+        {
+            // Same formula as in waveform(), using the band-limited triangle
+            // table: ret = tri(t + k / 2) - 2 * tri(t) - 1 where tri() is a
+            // triangle wave of amplitude 1 and k a triangle wave of period 128.
+            float const *tri = tables.periodic[INST_TRIANGLE][level];
+            uint32_t p = phase & 0x7fffffff;
+            uint32_t k = p < 0x40000000 ? 0x40000000 - p : p - 0x40000000;
+            uint32_t u = ((phase << 8) + (k << 1)) >> (32 - table_bits - 8);
+            uint32_t t = (phase << 8) >> (32 - table_bits - 8);
+            float ret = lerp(tri, u >> 8, u & 0xff, 8)
+                      - 2.f * lerp(tri, t >> 8, t & 0xff, 8);
+            return (ret / 0.354f - 1.f) * 0.166666666f;
+        }
+        default:
+        {
+            float const *table = tables.periodic[instrument & 7][level];
+            uint32_t t = (phase << 8) >> (32 - table_bits - 8);
+            return lerp(table, t >> 8, t & 0xff, 8);
+        }
+    }
+}
+
 float synth::waveform(int instrument, float advance)
 {
     float t = lol::fmod(advance, 1.f);
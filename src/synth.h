@@ -36,8 +36,64 @@ public:
         INST_PHASER     = 7,
     };
 
+    // Reference waveforms, evaluated directly; slow and not band-limited
     static float waveform(int instrument, float advance);
+
+    // Precompute the wavetables used by sample()
+    static void init();
+
+    // Band-limited wavetable oscillator. The phase is a 8.24 fixed point
+    // number of periods, wrapping every 256 periods. The level should be
+    // computed using get_level() for the highest frequency to be played.
+    static float sample(int instrument, int level, uint32_t phase);
+    static int get_level(float freq, float samples_per_second);
+
+    // Phase increment per sample for the given frequency
+    static uint32_t get_step(float freq, float samples_per_second)
+    {
+        return (uint32_t)(freq / samples_per_second * (1 << 24));
+    }
+
+    //
+    // Noise generator for INST_NOISE. Each voice owns one, so the output
+    // only depends on the seed and the notes played. A xorshift generator
+    // is sampled 16 times per period and smoothed by a one-pole lowpass
+    // filter whose cutoff follows the note frequency, which gives brown
+    // noise at low pitches and brighter noise at high pitches.
+    //
+
+    class noise
+    {
+    public:
+        void reset(uint32_t seed)
+        {
+            m_state = seed ? seed : 0x2545f491;
+            m_value = m_out = 0.f;
+            m_last = 0;
+        }
+
+        uint32_t seed() const { return m_state; }
+
+        float next(uint32_t phase, uint32_t step)
+        {
+            if ((phase ^ m_last) >> 20)
+            {
+                m_state ^= m_state << 13;
+                m_state ^= m_state >> 17;
+                m_state ^= m_state << 5;
+                m_value = (int32_t)m_state * (1.f / 2147483648.f);
+            }
+            m_last = phase;
+
+            float const a = lol::min(1.f, step * (1.f / (1 << 20)));
+            m_out += a * (m_value - m_out);
+            return m_out * 0.4f;
+        }
+
+    private:
+        uint32_t m_state = 0x2545f491, m_last = 0;
+        float m_value = 0.f, m_out = 0.f;
+    };
 };
 
 } // namespace z8
-
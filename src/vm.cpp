@@ -21,6 +21,16 @@
 namespace z8
 {
 
+void vm_base::snapshot(frame &f) const
+{
+    auto [state, state_size] = get_render_state();
+    ASSERT(state_size <= sizeof(f.state));
+
+    memcpy(&f.screen, &get_screen(), sizeof(f.screen));
+    memcpy(f.state, state, state_size);
+    f.state_size = state_size;
+}
+
 void vm_base::print_ansi(lol::ivec2 term_size,
                          uint8_t const *prev_screen) const
 {
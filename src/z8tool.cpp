@@ -16,6 +16,7 @@
 
 #include <lol/engine.h>
 
+#include <filesystem>
 #include <fstream>
 #include <sstream>
 #include <iostream>
@@ -27,12 +28,16 @@
 
 #include "zepto8.h"
 #include "pico8/vm.h"
+#include "pico8/pxa.h"
 #include "raccoon/vm.h"
 #include "telnet.h"
 #include "splore.h"
 #include "dither.h"
 #include "minify.h"
 #include "compress.h"
+#include "squeeze.h"
+#include "audio.h"
+#include "batch.h"
 
 enum class mode
 {
@@ -45,12 +50,16 @@ enum class mode
     dither   = 135,
     minify   = 136,
     compress = 137,
+    render_audio = 138,
+    decompress = 139,
+    verify   = 147,
 
     tolua  = 140,
     topng  = 141,
     top8   = 143,
     tobin  = 144,
     todata = 145,
+    tocache = 146,
 
     out     = 'o',
     data    = 150,
@@ -58,21 +67,36 @@ enum class mode
     error_diffusion = 152,
     raw     = 153,
     skip    = 154,
+    sfx     = 155,
+    music   = 156,
+    rate    = 157,
+    best    = 158,
+    size    = 159,
+    pxa     = 160,
+    bench   = 161,
+    cache   = 162,
 };
 
 static void usage()
 {
-    printf("Usage: z8tool [--tolua|--topng|--top8|--tobin|--todata] [--data <file>] <cart> [-o <file>]\n");
-    printf("       z8tool --dither [--hicolor] [--error-diffusion] <image> [-o <file>]\n");
+    printf("Usage: z8tool [--tolua|--topng|--top8|--tobin|--todata|--tocache] [--pxa] [--data <file>] <cart> [-o <file>]\n");
+    printf("       z8tool [--tolua|--topng|--top8|--tobin|--todata|--tocache] [--pxa] <cart|dir>... -o <dir>\n");
+    printf("       z8tool --dither [--hicolor] [--error-diffusion] [--size <w>x<h>] <image|dir> [-o <file>]\n");
     printf("       z8tool --minify\n");
-    printf("       z8tool --compress [--raw <num>] [--skip <num>]\n");
+    printf("       z8tool --compress [--best] [--raw <num>] [--skip <num>]\n");
+    printf("       z8tool --decompress\n");
+    printf("       z8tool --verify [--best]\n");
+    printf("       z8tool --verify <cart>\n");
+    printf("       z8tool --render-audio <cart> [--sfx <num>|--music <num>] [--rate <hz>] [-o <file>]\n");
     printf("       z8tool --run <cart>\n");
-    printf("       z8tool --inspect <cart>\n");
+    printf("       z8tool --inspect [--bench] <cart|dir>...\n");
     printf("       z8tool --headless <cart>\n");
 #if HAVE_UNISTD_H
     printf("       z8tool --telnet <cart>\n");
 #endif
     printf("       z8tool --splore <image>\n");
+    printf("Carts are loaded from their cache in <dir> when given --cache <dir>,\n");
+    printf("and --tocache writes the cache there by default.\n");
 }
 
 int main(int argc, char **argv)
@@ -85,18 +109,30 @@ int main(int argc, char **argv)
     opt.add_opt(int(mode::dither),   "dither",   true);
     opt.add_opt(int(mode::minify),   "minify",   false);
     opt.add_opt(int(mode::compress), "compress", false);
+    opt.add_opt(int(mode::decompress), "decompress", false);
+    opt.add_opt(int(mode::verify),   "verify",   false);
     opt.add_opt(int(mode::inspect),  "inspect",  true);
+    opt.add_opt(int(mode::render_audio), "render-audio", true);
     opt.add_opt(int(mode::headless), "headless", true);
     opt.add_opt(int(mode::tolua),    "tolua",    false);
     opt.add_opt(int(mode::topng),    "topng",    false);
     opt.add_opt(int(mode::top8),     "top8",     false);
     opt.add_opt(int(mode::tobin),    "tobin",    false);
     opt.add_opt(int(mode::todata),   "todata",   false);
+    opt.add_opt(int(mode::tocache),  "tocache",  false);
     opt.add_opt(int(mode::out),      "out",      true);
     opt.add_opt(int(mode::data),     "data",     true);
     opt.add_opt(int(mode::hicolor),  "hicolor",  false);
     opt.add_opt(int(mode::raw),      "raw",      true);
     opt.add_opt(int(mode::skip),     "skip",     true);
+    opt.add_opt(int(mode::sfx),      "sfx",      true);
+    opt.add_opt(int(mode::music),    "music",    true);
+    opt.add_opt(int(mode::rate),     "rate",     true);
+    opt.add_opt(int(mode::best),     "best",     false);
+    opt.add_opt(int(mode::size),     "size",     true);
+    opt.add_opt(int(mode::pxa),      "pxa",      false);
+    opt.add_opt(int(mode::bench),    "bench",    false);
+    opt.add_opt(int(mode::cache),    "cache",    true);
     opt.add_opt(int(mode::error_diffusion), "error-diffusion", false);
 #if HAVE_UNISTD_H
     opt.add_opt(int(mode::telnet),   "telnet",   true);
@@ -108,8 +144,13 @@ int main(int argc, char **argv)
     char const *in = nullptr;
     char const *out = nullptr;
     size_t raw = 0, skip = 0;
+    int sfx = -1, music = -1, rate = 22050;
     bool hicolor = false;
     bool error_diffusion = false;
+    bool best = false;
+    bool pxa = false;
+    bool bench = false;
+    lol::ivec2 size(128);
 
     for (;;)
     {
@@ -128,16 +169,20 @@ int main(int argc, char **argv)
         case (int)mode::dither:
         case (int)mode::telnet:
         case (int)mode::splore:
+        case (int)mode::render_audio:
             run_mode = mode(c);
             in = opt.arg;
             break;
         case (int)mode::minify:
         case (int)mode::compress:
+        case (int)mode::decompress:
+        case (int)mode::verify:
         case (int)mode::tolua:
         case (int)mode::topng:
         case (int)mode::top8:
         case (int)mode::tobin:
         case (int)mode::todata:
+        case (int)mode::tocache:
             run_mode = mode(c);
             break;
         case (int)mode::data:
@@ -155,9 +200,35 @@ int main(int argc, char **argv)
         case (int)mode::skip:
             skip = atoi(opt.arg);
             break;
+        case (int)mode::sfx:
+            sfx = atoi(opt.arg);
+            break;
+        case (int)mode::music:
+            music = atoi(opt.arg);
+            break;
+        case (int)mode::rate:
+            rate = lol::clamp(atoi(opt.arg), 8000, 192000);
+            break;
         case (int)mode::error_diffusion:
             error_diffusion = true;
             break;
+        case (int)mode::best:
+            best = true;
+            break;
+        case (int)mode::size:
+            if (sscanf(opt.arg, "%dx%d", &size.x, &size.y) < 2)
+                size.y = size.x;
+            size = lol::ivec2(lol::clamp(size.x, 1, 4096), lol::clamp(size.y, 1, 4096));
+            break;
+        case (int)mode::pxa:
+            pxa = true;
+            break;
+        case (int)mode::bench:
+            bench = true;
+            break;
+        case (int)mode::cache:
+            z8::pico8::cart::set_cache_dir(opt.arg);
+            break;
         default:
             return EXIT_FAILURE;
         }
@@ -166,9 +237,46 @@ int main(int argc, char **argv)
     if (!in)
         in = argv[opt.index];
 
-    if (run_mode == mode::tolua || run_mode == mode::top8 ||
-        run_mode == mode::tobin || run_mode == mode::topng ||
-        run_mode == mode::todata || run_mode == mode::inspect)
+    bool const is_conversion = run_mode == mode::tolua || run_mode == mode::top8 ||
+                               run_mode == mode::tobin || run_mode == mode::topng ||
+                               run_mode == mode::todata || run_mode == mode::tocache;
+
+    if (is_conversion && in && (opt.index + 1 < argc || std::filesystem::is_directory(in)))
+    {
+        // Several carts or a directory: convert them all in parallel,
+        // using the output argument as the destination directory
+        if (!out)
+        {
+            lol::msg::error("converting several carts needs an output directory (-o)\n");
+            return EXIT_FAILURE;
+        }
+
+        // Replacing the ROM data only makes sense for a single cart
+        if (data)
+        {
+            lol::msg::error("--data cannot be used with several carts\n");
+            return EXIT_FAILURE;
+        }
+
+        z8::cart_format format = run_mode == mode::tolua ? z8::cart_format::lua
+                               : run_mode == mode::top8 ? z8::cart_format::p8
+                               : run_mode == mode::tobin ? z8::cart_format::bin
+                               : run_mode == mode::topng ? z8::cart_format::png
+                               : run_mode == mode::todata ? z8::cart_format::data
+                               : z8::cart_format::cache;
+        std::vector<std::string> inputs(argv + opt.index, argv + argc);
+        if (!z8::convert_carts(inputs, out, format, pxa))
+            return EXIT_FAILURE;
+    }
+    else if (run_mode == mode::inspect)
+    {
+        // The cart argument and any extra arguments are all inspected
+        std::vector<std::string> inputs(1, in);
+        inputs.insert(inputs.end(), argv + opt.index, argv + argc);
+        if (!z8::inspect_carts(inputs, bench))
+            return EXIT_FAILURE;
+    }
+    else if (is_conversion)
     {
         z8::pico8::cart cart;
         cart.load(in);
@@ -203,23 +311,28 @@ int main(int argc, char **argv)
         }
         else if (run_mode == mode::tobin)
         {
-            auto const &bin = cart.get_bin();
+            auto const &bin = cart.get_bin(pxa);
             fwrite(bin.data(), 1, bin.size(), stdout);
         }
         else if (run_mode == mode::topng)
         {
             if (!out)
                 return EXIT_FAILURE;
-            cart.get_png().save(out);
+            cart.save_png(out, pxa);
         }
         else if (run_mode == mode::todata)
         {
             fwrite(&cart.get_rom(), 1, 0x4300, stdout);
         }
-        else if (run_mode == mode::inspect)
+        else if (run_mode == mode::tocache)
         {
-            printf("Code size: %d\n", (int)cart.get_p8().size());
-            printf("Compressed code size: %d\n", (int)cart.get_compressed_code().size());
+            // Caches are named after their source hash unless told otherwise
+            std::string name = out ? out : cart.get_cache_name();
+            auto const &cache = cart.get_cache();
+            std::ofstream f(name, std::ios::binary);
+            f.write((char const *)cache.data(), cache.size());
+            if (!f)
+                return EXIT_FAILURE;
         }
     }
     else if (run_mode == mode::run || run_mode == mode::headless)
@@ -242,9 +355,31 @@ int main(int argc, char **argv)
             }
         }
     }
+    else if (run_mode == mode::render_audio)
+    {
+        bool ret;
+        if (sfx >= 0 || music >= 0)
+        {
+            if (!out)
+            {
+                lol::msg::error("--render-audio with --sfx or --music needs an output file (-o)\n");
+                usage();
+                return EXIT_FAILURE;
+            }
+            ret = z8::render_audio(in, music >= 0, music >= 0 ? music : sfx, out, rate);
+        }
+        else
+        {
+            // Render everything, using the output argument as a prefix
+            ret = z8::render_all_audio(in, out ? out : "", rate);
+        }
+        if (!ret)
+            return EXIT_FAILURE;
+    }
     else if (run_mode == mode::dither)
     {
-        z8::dither(in, out, hicolor, error_diffusion);
+        if (!z8::dither(in, out, hicolor, error_diffusion, size))
+            return EXIT_FAILURE;
     }
     else if (run_mode == mode::minify)
     {
@@ -252,7 +387,36 @@ int main(int argc, char **argv)
                                   std::istreambuf_iterator<char>() };
         std::cout << z8::minify(input) << '\n';
     }
-    else if (run_mode == mode::compress)
+    else if (run_mode == mode::verify && in)
+    {
+        // Store the cart code in both ROM formats and decode it again
+        // like a .p8.png cart, then compare with the original code
+        z8::pico8::cart cart;
+        if (!cart.load(in))
+        {
+            lol::msg::error("could not load %s\n", in);
+            return EXIT_FAILURE;
+        }
+
+        bool ok = true;
+        for (bool use_pxa : { false, true })
+        {
+            z8::pico8::cart copy;
+            bool const same = copy.load_bin(cart.get_bin(use_pxa))
+                               && copy.get_code() == cart.get_code();
+            if (!same)
+                lol::msg::error("%s: %s verification failed\n", in, use_pxa ? "PXA" : ":c:");
+            ok = ok && same;
+        }
+
+        if (!ok)
+            return EXIT_FAILURE;
+        lol::msg::info("%s: %d characters, %d bytes in :c: format, %d bytes in PXA format\n",
+                       in, (int)cart.get_code().length(),
+                       (int)cart.get_compressed_code().size() + 8,
+                       (int)z8::pico8::pxa::compress(cart.get_code()).size());
+    }
+    else if (run_mode == mode::compress || run_mode == mode::verify)
     {
         std::vector<uint8_t> input;
 #if _MSC_VER
@@ -264,9 +428,36 @@ int main(int argc, char **argv)
 
         // Compress input buffer
         std::vector<uint8_t> output = z8::compress(input);
+        if (best)
+        {
+            std::vector<uint8_t> squeezed = z8::squeeze(input);
+            lol::msg::info("zlib: %d bytes, exhaustive: %d bytes (%d bytes saved)\n",
+                           (int)output.size(), (int)squeezed.size(),
+                           (int)output.size() - (int)squeezed.size());
+            if (squeezed.size() < output.size())
+                output = std::move(squeezed);
+        }
 
+        if (run_mode == mode::verify)
+        {
+            // Decompress like unz8 does, and compare with the input,
+            // including the zero padding of the last 32-bit number
+            std::string encoded = z8::encode59(output);
+            std::vector<uint32_t> words;
+            bool ok = z8::unz8(encoded, words) && words.size() == (input.size() + 3) / 4;
+            for (size_t i = 0; ok && i < words.size() * 4; ++i)
+                ok = uint8_t(words[i / 4] >> (i % 4 * 8)) == (i < input.size() ? input[i] : 0);
+
+            if (!ok)
+            {
+                lol::msg::error("verification failed\n");
+                return EXIT_FAILURE;
+            }
+            lol::msg::info("%d bytes compressed to %d bytes, %d characters\n",
+                           (int)input.size(), (int)output.size(), (int)encoded.size());
+        }
         // Output result, encoded according to user-provided flags
-        if (raw > 0)
+        else if (raw > 0)
         {
             fwrite(output.data(), 1, std::min(raw, output.size()), stdout);
         }
@@ -277,6 +468,27 @@ int main(int argc, char **argv)
             std::cout << z8::encode59(output) << '\n';
         }
     }
+    else if (run_mode == mode::decompress)
+    {
+        auto input = std::string{ std::istreambuf_iterator<char>(std::cin),
+                                  std::istreambuf_iterator<char>() };
+        std::vector<uint32_t> words;
+        if (!z8::unz8(input, words))
+        {
+            lol::msg::error("invalid compressed data\n");
+            return EXIT_FAILURE;
+        }
+
+        // Output the bytes of the 32-bit numbers, as poke4() would
+        std::vector<uint8_t> output;
+        for (uint32_t x : words)
+            for (int i = 0; i < 4; ++i)
+                output.push_back(uint8_t(x >> (i * 8)));
+#if _MSC_VER
+        _setmode(_fileno(stdout), _O_BINARY);
+#endif
+        fwrite(output.data(), 1, output.size(), stdout);
+    }
     else if (run_mode == mode::splore)
     {
         z8::splore splore;
@@ -67,6 +67,19 @@ public:
     uint8_t data[H][W / 2];
 };
 
+//
+// A snapshot of everything render() needs: the 4-bit screen and the
+// render state (e.g. the screen palette). Frames can be rendered on
+// another thread than the one running the VM.
+//
+
+struct frame
+{
+    u4mat2<128, 128> screen;
+    uint8_t state[64];
+    size_t state_size = 0;
+};
+
 //
 // The generic VM interface
 //
@@ -85,8 +98,13 @@ public:
 
     // Rendering
     virtual void render(lol::u8vec4 *screen) const = 0;
+    virtual void render(lol::u8vec4 *screen, frame const &f) const = 0;
     virtual u4mat2<128, 128> const &get_screen() const = 0;
     virtual int get_ansi_color(uint8_t c) const = 0;
+    // Memory other than the screen that affects render() output, such
+    // as the screen palette; used to detect frames that did not change.
+    virtual std::tuple<uint8_t const *, size_t> get_render_state() const = 0;
+    void snapshot(frame &f) const;
     // FIXME: get_ansi_color() should be get_rgb(), and render()
     // should be removed in favour of a generic function that
     // uses get_rgb() too.
@@ -97,8 +115,9 @@ public:
     // Code
     virtual std::string const &get_code() const = 0;
 
-    // Audio streaming
-    virtual std::function<void(void *, int)> get_streamer(int channel) = 0;
+    // Audio streaming; all channels are mixed into a single mono S16
+    // stream, synthesised directly at the requested sample rate
+    virtual std::function<void(void *, int)> get_streamer(int sample_rate) = 0;
 
     // IO
     virtual void button(int index, int state) = 0;
@@ -918,7 +918,7 @@ void ZLIB_INTERNAL _tr_stored_block(s, buf, stored_len, last)
     send_bits(s, 2, 2); /* send block header */
     send_bits(s, (ush)stored_len, 16);
     for (ulg i = 0; i < stored_len; ++i)
-        send_bits(s, buf[i], 8);
+        send_bits(s, (uch)buf[i], 8);
 #else
     send_bits(s, (STORED_BLOCK<<1)+last, 3);    /* send block type */
     bi_windup(s);        /* align on byte boundary */